@@ -0,0 +1,225 @@
+/*
+ * Control socket for scripts, see control.h
+ *
+ * Clients connect to a unix stream socket and send commands, each
+ * on a line of its own:
+ *
+ *	A name		show terminal name, creating it if needed
+ *	I name len	followed by len bytes, sent to the shell as they
+ *			are, after the keys already queued
+ *	Q		one line per terminal: name rows cols, and
+ *			a * on the one shown
+ *	S		the counters, see stats.c
+ *	T		write the trace to TraceFile, see trace.c
+ *
+ * Every command is answered with "ok" or "err reason" on a line,
+ * after its output if any. Commands are run by the main loop as soon
+ * as they arrive, in order, also those before the client shuts down
+ * its side (e.g. nc -N). The socket is only for its owner.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "myts.h"
+#include "terminal.h"
+#include "control.h"
+#include "stats.h"
+#include "trace.h"
+
+#define CTL_LINE	256	/* max command line */
+#define CTL_DATA	65536	/* max bytes of an I command */
+
+struct ctl_conn {
+	struct sess sess;
+	dynstr in, out;
+	int eof;	/* the client is done sending */
+};
+
+static struct {
+	struct sess *sess;	/* the listening socket */
+	char *path;
+	const struct ctl_ops *ops;
+} ctl;
+
+/*
+ * run the first command in c->in, if complete. Returns the bytes
+ * used, 0 if more are needed, -1 on protocol errors.
+ */
+static int ctl_command(struct ctl_conn *c)
+{
+	const char *d = ds_data(c->in), *nl;
+	char line[CTL_LINE], name[CTL_LINE];
+	int l, len = 0;
+	struct sess *s;
+
+	nl = memchr(d, '\n', ds_len(c->in));
+	if (nl == NULL)
+		return ds_len(c->in) < CTL_LINE ? 0 : -1;
+	l = nl - d;
+	if (l >= CTL_LINE)
+		return -1;
+	memcpy(line, d, l);
+	line[l] = '\0';
+	if (l && line[l - 1] == '\r')
+		line[l - 1] = '\0';
+	DBG(1, "command '%s'\n", line);
+	TRACE(1, TR_CTL, c->sess.fd, line[0], ds_len(c->in));
+	name[0] = '\0';
+	switch (line[0]) {
+	case 'A':
+		if (sscanf(line + 1, "%255s", name) != 1)
+			break;
+		if (ctl.ops->show(name))
+			dsprintf(&c->out, "err no %s\n", name);
+		else
+			dsprintf(&c->out, "ok\n");
+		return l + 1;
+	case 'I':
+		if (sscanf(line + 1, "%255s %d", name, &len) != 2 ||
+		    len < 0 || len > CTL_DATA)
+			break;
+		if (ds_len(c->in) < l + 1 + len)
+			return 0;	/* wait for the data */
+		s = term_find(name);
+		if (s == NULL)
+			dsprintf(&c->out, "err no %s\n", name);
+		else if (term_inject(s, nl + 1, len))
+			dsprintf(&c->out, "err busy\n");
+		else
+			dsprintf(&c->out, "ok\n");
+		return l + 1 + len;
+	case 'Q':
+		ctl.ops->query(&c->out);
+		dsprintf(&c->out, "ok\n");
+		return l + 1;
+	case 'S':
+		ctl.ops->stats(&c->out);
+		dsprintf(&c->out, "ok\n");
+		return l + 1;
+	case 'T':
+		dsprintf(&c->out, trace_dump() ? "err cannot write the trace\n" : "ok\n");
+		return l + 1;
+	}
+	dsprintf(&c->out, "err bad command\n");
+	return line[0] == 'I' ? -1 : l + 1;	/* cannot skip the data */
+}
+
+static int ctl_client(void *_c, struct cb_args *a)
+{
+	struct ctl_conn *c = _c;
+	int fd = c->sess.fd, l, dead = 0;
+	char buf[1024];
+
+	/* all that is there, readiness may not be reported again */
+	while (!c->eof && ds_len(c->in) < CTL_LINE + CTL_DATA) {
+		l = read(fd, buf, sizeof(buf));
+		if (l > 0) {
+			ds_append(&c->in, buf, l);
+			continue;
+		}
+		if (l == 0)	/* still run and answer what was sent */
+			c->eof = 1;
+		else if (errno != EAGAIN)
+			dead = 1;
+		break;
+	}
+	if (ds_len(c->in) >= CTL_LINE + CTL_DATA)
+		sess_wake(&c->sess);	/* the rest after these commands */
+	while (!dead && (l = ctl_command(c)) != 0) {
+		if (l < 0)
+			dead = 1;
+		else
+			ds_shift(c->in, l);
+	}
+	if (ds_len(c->out)) {
+		l = write(fd, ds_data(c->out), ds_len(c->out));
+		if (l > 0)
+			ds_shift(c->out, l);
+		else if (errno != EAGAIN)
+			dead = 1;
+	}
+	if (c->eof && ds_len(c->out) == 0)	/* all answered */
+		dead = 1;
+	if (dead) {
+		DBG(1, "control client %d gone\n", fd);
+		sess_watch(&c->sess, fd, 0);
+		close(fd);
+		ds_free(c->in);
+		ds_free(c->out);
+		free(c);
+		return 1;
+	}
+	sess_watch(&c->sess, fd, (c->eof ? 0 : SESS_READ) |
+		(ds_len(c->out) ? SESS_WRITE : 0));
+	return 0;
+}
+
+static int ctl_accept(void *_s, struct cb_args *a)
+{
+	struct sess *s = _s;
+	struct ctl_conn *c;
+	int fd;
+
+	if (s != ctl.sess) {	/* closed by ctl_open() */
+		free(s);
+		return 1;
+	}
+	while ((fd = accept(s->fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c = new_sess(sizeof(*c), fd, ctl_client, NULL);
+		if (c)
+			c->sess.flags &= ~SF_POLL;
+		stats_name(ctl_client, "control client");
+		DBG(1, "control client %d\n", fd);
+	}
+	return 0;
+}
+
+int ctl_open(const char *path, const struct ctl_ops *ops)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct sess *s;
+	int fd;
+
+	if (ops)
+		ctl.ops = ops;
+	if (ctl.path && path && !strcmp(path, ctl.path))
+		return 0;
+	if (ctl.sess) {	/* clients stay connected */
+		sess_watch(ctl.sess, ctl.sess->fd, 0);
+		close(ctl.sess->fd);
+		sess_wake(ctl.sess);	/* to be freed */
+		ctl.sess = NULL;
+		unlink(ctl.path);
+	}
+	free(ctl.path);
+	ctl.path = NULL;
+	if (path == NULL)
+		return 0;
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -1;
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	unlink(path);	/* left by a previous run */
+	/* whoever connects can type into the shells */
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    chmod(path, 0600) || listen(fd, 4)) {
+		DBG(0, "cannot listen on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	s = new_sess(sizeof(*s), fd, ctl_accept, NULL);
+	if (s == NULL)
+		return -1;
+	s->flags &= ~SF_POLL;
+	stats_name(ctl_accept, "control");
+	ctl.sess = s;
+	ctl.path = strdup(path);
+	DBG(0, "control socket %s\n", path);
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Control socket for scripts, see control.c
+ */
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include "dynstring.h"
+
+/* what the application does for the commands */
+struct ctl_ops {
+	int (*show)(const char *name);	/* 0 if shown */
+	void (*query)(dynstr *reply);	/* one line per terminal */
+	void (*stats)(dynstr *reply);	/* the counters */
+};
+
+/* listen on path, replacing any previous socket. NULL closes it. */
+int ctl_open(const char *path, const struct ctl_ops *ops);
+
+#endif /* _CONTROL_H_ */
@@ -1,67 +1,387 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
 #include "myts.h"
 #include "pixop.h"
 #include "font.h"
 
-#define MAXCHARS 4096
-#define FONTBLOCK 256
-
-uint32_t *quadbits;
+#define GLYPHBLOCK 64           /* glyphs per arena chunk */
+#define MAXCODE 0x110000        /* all of unicode */
 
 int bytesperchar;
 
 struct font font_pixmap = {
         .code_first = 0,
         .code_last = 255,
-        .bpp =  4,
+        .bpp =  1,
+};
+
+/*
+ * Glyphs are kept at 1bpp, one or two bytes per row, and expanded to
+ * the 4bpp of the screen by pix_blt().
+ *
+ * Binary fonts (.fnt, made by hex2fnt) hold the glyphs ready to use,
+ * so loading one is a single mmap and the pages are shared with the
+ * page cache. Little endian layout: the header, nglyphs sorted code
+ * points (uint32), then nglyphs glyphs of 'bytes' bytes.
+ */
+struct fnt_header {
+    char magic[4];              /* "MYF1" */
+    uint16_t width, height;     /* in pixels */
+    uint32_t nglyphs;
+    uint32_t bytes;             /* per glyph */
+};
+
+/*
+ * A .hex font is mapped and only indexed at load time. Glyphs are
+ * decoded the first time they are drawn, into chunks of an arena,
+ * so the cost scales with the characters actually displayed.
+ *
+ * In UTF8 mode code points map to glyphs through a two level table:
+ * pages[code >> 8] is allocated only if the font has some glyph in
+ * that range, and holds 1 + the index in glyph[], 0 if missing.
+ */
+struct glyph {
+    uint32_t code;
+    uint32_t ofs;               /* of the bitmap in the .hex file */
+    uint8_t *pix;               /* NULL until decoded */
 };
 
-#define BE2LE(x) (x << 24 | x >> 24 | (x & (uint32_t)0x0000ff00UL) << 8 | (x & (uint32_t)0x00ff0000UL) >> 8)
+struct chunk {
+    struct chunk *next;
+    uint8_t pix[0];
+};
+
+static struct {
+    char *map;                  /* the mapped font file, if in use */
+    size_t size;
+    struct glyph *glyph;        /* sorted by code */
+    int n;
+    uint32_t *pages[MAXCODE >> 8];
+    uint32_t fallback;          /* slot used for missing codes */
+    int digits;                 /* hex digits per glyph row */
+    int bytes;                  /* per decoded glyph */
+    pthread_mutex_t lock;       /* render threads may decode glyphs */
+    struct chunk *arena;
+    int used;                   /* glyphs used in the first chunk */
+} fs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .used = GLYPHBLOCK,
+};
+
+static int code_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* sort by code, then by position so that the last definition wins */
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct glyph *x = a, *y = b;
+    if (x->code != y->code)
+        return x->code < y->code ? -1 : 1;
+    return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
+}
+
+static inline int hexval(int c)
+{
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+static void *map_file(const char *name, size_t *size)
+{
+    struct stat sb;
+    void *p;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sb) || sb.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    *size = sb.st_size;
+    return p;
+}
+
+static void free_font(void)
+{
+    struct chunk *c;
+    int i;
+
+    if (fs.map)
+        munmap(fs.map, fs.size);
+    fs.map = NULL;
+    free(fs.glyph);
+    fs.glyph = NULL;
+    fs.n = 0;
+    for (i = 0; i < MAXCODE >> 8; i++) {
+        free(fs.pages[i]);
+        fs.pages[i] = NULL;
+    }
+    fs.fallback = 0;
+    while ((c = fs.arena)) {
+        fs.arena = c->next;
+        free(c);
+    }
+    fs.used = GLYPHBLOCK;
+    free(font_pixmap.pixmap);
+    font_pixmap.pixmap = NULL;
+}
+
+/* foo.hex -> foo.fnt */
+static char *fnt_name(const char *font)
+{
+    int l = strlen(font);
+    char *s;
+
+    if (l > 4 && !strcmp(font + l - 4, ".hex"))
+        l -= 4;
+    s = malloc(l + 5);
+    if (s) {
+        memcpy(s, font, l);
+        strcpy(s + l, ".fnt");
+    }
+    return s;
+}
+
+/*
+ * Use the binary version of the font if there is one matching the
+ * configured size: the one built into the program if the name is the
+ * same, or foo.fnt next to foo.hex. With a codepage the 256 glyphs are
+ * copied and the file is unmapped, otherwise glyph[] points into it.
+ */
+static int load_fnt(const char *font, const unsigned short *cpb)
+{
+    const struct fnt_header *h;
+    const uint32_t *codes, *c;
+    const char *img, *base = strrchr(font, '/');
+    uint8_t *glyphs;
+    size_t size;
+    int i;
+
+    base = base ? base + 1 : font;
+    if (!strcmp(base, deffont_name)) {
+        img = (const char *)deffont;
+        size = deffont_size;
+    } else {
+        char *name = fnt_name(font);
+
+        fs.map = name ? map_file(name, &fs.size) : NULL;
+        free(name);
+        if (fs.map == NULL)
+            return -1;
+        img = fs.map;
+        size = fs.size;
+    }
+    h = (const struct fnt_header *)img;
+    if (size < sizeof(*h) || memcmp(h->magic, "MYF1", 4) ||
+            h->width != font_pixmap.width ||
+            h->height != font_pixmap.height || h->bytes != fs.bytes ||
+            size < sizeof(*h) + (size_t)h->nglyphs*(4 + fs.bytes)) {
+        DBG(0, "%s does not match the font settings\n", font);
+        goto fail;
+    }
+    codes = (const uint32_t *)(h + 1);
+    glyphs = (uint8_t *)(codes + h->nglyphs);
+    if (bytesperchar == 2) {
+        fs.glyph = calloc(h->nglyphs, sizeof(*fs.glyph));
+        if (fs.glyph == NULL)
+            goto fail;
+        for (i = 0; i < h->nglyphs; i++) {
+            fs.glyph[i].code = codes[i];
+            fs.glyph[i].pix = glyphs + i*fs.bytes;
+        }
+        fs.n = h->nglyphs;
+    } else {
+        for (i = 0; i < 256; i++) {
+            uint32_t key = cpb[i];
+            c = bsearch(&key, codes, h->nglyphs, sizeof(*codes), code_cmp);
+            if (c)
+                memcpy(font_pixmap.pixmap + i*fs.bytes,
+                        glyphs + (c - codes)*fs.bytes, fs.bytes);
+        }
+        if (fs.map)
+            munmap(fs.map, fs.size);
+        fs.map = NULL;
+    }
+    DBG(1, "%s: %d glyphs from the binary font\n", font, h->nglyphs);
+    return 0;
+
+fail:
+    if (fs.map)
+        munmap(fs.map, fs.size);
+    fs.map = NULL;
+    return -1;
+}
 
-static void calcquadbits()
+/*
+ * Index the lines of the mapped .hex with a bitmap of the right
+ * size. Lines are 'code:bitmap', with 2 or 4 digits per glyph row.
+ */
+static int index_hex(void)
 {
-    unsigned int j;
-    int i,k;
-    for (i=0;i<256;i++) {
-        j=0;
-        for(k=0;k<8;k++) {
-            j<<=4;
-            if(i&(128>>k))j+=15;
+    const char *p = fs.map, *end = fs.map + fs.size, *nl, *q;
+    int i, j, len, max = 0;
+
+    fs.digits = font_pixmap.width > 8 ? 4 : 2;
+    for (; p < end; p = nl + 1) {
+        uint32_t code = 0;
+
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            nl = end;
+        for (q = p; q < nl && isxdigit(*q); q++)
+            code = code*16 + hexval(*q);
+        if (q == p || q == nl || *q++ != ':')
+            continue;
+        len = nl - q;
+        if (len > 0 && q[len - 1] == '\r')
+            len--;
+        if (len != fs.digits*font_pixmap.height)
+            continue;
+        for (i = 0; i < len && isxdigit(q[i]); i++)
+            ;
+        if (i < len)
+            continue;
+        if (fs.n == max) {
+            void *tmp;
+            max = max ? 2*max : 1024;
+            tmp = realloc(fs.glyph, max*sizeof(*fs.glyph));
+            if (tmp == NULL)
+                return -1;
+            fs.glyph = tmp;
         }
-        quadbits[i]=BE2LE(j);
-        DBG(2,"quadbits[%02x]=%08x\n", i, j);
+        fs.glyph[fs.n].code = code;
+        fs.glyph[fs.n].pix = NULL;
+        fs.glyph[fs.n++].ofs = q - fs.map;
+    }
+    qsort(fs.glyph, fs.n, sizeof(*fs.glyph), entry_cmp);
+    for (i = j = 0; i < fs.n; i++) {    /* drop duplicates */
+        if (j > 0 && fs.glyph[j - 1].code == fs.glyph[i].code)
+            j--;
+        fs.glyph[j++] = fs.glyph[i];
+    }
+    fs.n = j;
+    DBG(1, "%d glyphs in the font\n", fs.n);
+    return 0;
+}
+
+static struct glyph *find_glyph(uint32_t code)
+{
+    return bsearch(&code, fs.glyph, fs.n, sizeof(*fs.glyph), code_cmp);
+}
+
+/* fill the page table, and pick the glyph for missing codes */
+static int build_pages(void)
+{
+    static const uint32_t fallbacks[] = { 0xfffd, '?', ' ' };
+    struct glyph *g;
+    uint32_t **pg;
+    int i;
+
+    for (i = 0; i < fs.n; i++) {
+        if (fs.glyph[i].code >= MAXCODE)
+            continue;
+        pg = &fs.pages[fs.glyph[i].code >> 8];
+        if (*pg == NULL && (*pg = calloc(256, sizeof(**pg))) == NULL)
+            return -1;
+        (*pg)[fs.glyph[i].code & 0xff] = i + 1;
+    }
+    for (i = 0; i < 3 && fs.fallback == 0; i++) {
+        g = find_glyph(fallbacks[i]);
+        if (g)
+            fs.fallback = g - fs.glyph + 1;
     }
+    return 0;
+}
+
+/* hex digits to bitmap bytes, one or two per row */
+static void decode_hex(const struct glyph *e, uint8_t *p)
+{
+    const char *s = fs.map + e->ofs;
+    int i;
+
+    for (i = 0; i < fs.bytes; i++, s += 2)
+        p[i] = hexval(s[0]) << 4 | hexval(s[1]);
+}
+
+/* decode a glyph on first use. */
+static uint8_t *hex_glyph(struct glyph *g)
+{
+    uint8_t *p;
+
+    pthread_mutex_lock(&fs.lock);
+    p = g->pix;
+    if (p)                      /* someone else did it */
+        goto done;
+    if (fs.used == GLYPHBLOCK) {
+        struct chunk *c = malloc(sizeof(*c) + GLYPHBLOCK*fs.bytes);
+        if (c == NULL)
+            goto done;
+        c->next = fs.arena;
+        fs.arena = c;
+        fs.used = 0;
+    }
+    p = fs.arena->pix + fs.used++*fs.bytes;
+    decode_hex(g, p);
+    __atomic_store_n(&g->pix, p, __ATOMIC_RELEASE);
+done:
+    pthread_mutex_unlock(&fs.lock);
+    return p;
+}
+
+/*
+ * The bitmap for a code point in UTF8 mode. Codes missing from
+ * the font get U+FFFD, or '?' or ' ' if that is missing too.
+ */
+uint8_t *font_glyph(int code)
+{
+    uint32_t *pg, slot = 0;
+    struct glyph *g;
+    uint8_t *p;
+
+    if (code >= 0 && code < MAXCODE && (pg = fs.pages[code >> 8]))
+        slot = pg[code & 0xff];
+    if (slot == 0)
+        slot = fs.fallback;
+    if (slot == 0)
+        return NULL;
+    g = &fs.glyph[slot - 1];
+    p = __atomic_load_n(&g->pix, __ATOMIC_ACQUIRE);
+    return p ? p : hex_glyph(g);
 }
 
 int init_font(const char *cp, const char *font, int fontheight, int fontwidth) {
     int cpf;
-    int i, width;
-    int charstodo;
-    FILE *fontf;
-    int charsdone;
+    int i;
     unsigned short cpb[256];
-    void **ftable=NULL;
-    uint8_t *fchar=NULL;
+    const struct glyph *e;
+
+    free_font();                /* drop the previous font, if any */
+    pix_init();
 
     font_pixmap.height = fontheight;
     font_pixmap.width = fontwidth;
-    width = (font_pixmap.width*font_pixmap.bpp+7)/8;
+    fs.bytes = (font_pixmap.width*font_pixmap.bpp+7)/8*fontheight;
     if(cp==NULL || !strcmp(cp,"UTF8")) {
-        font_pixmap.code_last=0xffff;
-
-        font_pixmap.pixmap=malloc(sizeof(void*)*65536);
+        font_pixmap.code_last=MAXCODE-1;
         bytesperchar=2;
-        ftable=(void **)font_pixmap.pixmap;
-        fchar=font_pixmap.pixmap+sizeof(void*)*65536;
-        charstodo=MAXCHARS;
     } else {
+        font_pixmap.code_last=255;
         font_pixmap.pixmap=calloc(1,(font_pixmap.code_last-font_pixmap.code_first+1)*
-                                width*font_pixmap.height);
+                                fs.bytes);
         bytesperchar=1;
         cpf=open(cp,O_RDONLY);
         if(cpf<0) return -1;
@@ -70,99 +390,34 @@ int init_font(const char *cp, const char *font, int fontheight, int fontwidth) {
             DBG(3,"CP Table %i = %04x\n", i, cpb[i]);
         }
         close(cpf);
-        charstodo=256;
-    }
-
-    fontf=fopen(font,"r");
-    if(fontf==0) return -2;
-    quadbits=malloc(1024);
-    calcquadbits();
-    charsdone=0;
-    char formatstring[200] = "%04x:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"; 
-    if(fontwidth>8) {
-        int i;
-        for(i=7;i<strlen(formatstring);i+=4)formatstring[i]='4';
-    }
-    while(!feof(fontf) && charsdone<charstodo){
-        char line[1024];
-        int i,j;
-        unsigned int pix[fontheight];
-
-        fgets(line,1022,fontf);
-        i=sscanf(line, formatstring,
-                &j, 
-                &pix[0], &pix[1], &pix[2], &pix[3],
-                &pix[4], &pix[5], &pix[6], &pix[7],
-                &pix[8], &pix[9], &pix[10], &pix[11],
-                &pix[12], &pix[13], &pix[14], &pix[15],
-                &pix[16], &pix[17], &pix[18], &pix[19],
-                &pix[20], &pix[21], &pix[22], &pix[23],
-                &pix[24], &pix[25], &pix[26], &pix[27],
-                &pix[28], &pix[29], &pix[30], &pix[31]
-                );
-        DBG(3,"i=%d\n",i);
-        if(i<fontheight+1) DBG(3, "Short font line. i=%d\n",i);
-        DBG(3, "Found unicode char %04x.\n", j);
-        if(i==fontheight+1) {
-            int l;
-            if(bytesperchar==1) {
-                for(l=0;l<256;l++){
-                    if(j==cpb[l]) {
-                        uint8_t *p,*q;
-                        int k,m;
-                        charsdone++;
-                        DBG(3, "Found char %04x %02x\n", j, l);
-                        p=(uint8_t *)(font_pixmap.pixmap+l*width*font_pixmap.height);
-                        for(k=0;k<fontheight;k++) {
-                            if(fontwidth>8) {
-                                q=(uint8_t *)&quadbits[(pix[k]>>8)&0xff];
-                                for(m=0;m<4;m++) *p++=*q++;
-                                q=(uint8_t *)&quadbits[pix[k]&0xff];
-                                for(m=0;m<width-4;m++) *p++=*q++;
-                            } else {
-                                q=(uint8_t *)&quadbits[pix[k]];
-                                for(m=0;m<width;m++) *p++=*q++;
-                            }
-                        }
-                    }
-                }
-            } else {
-                int k,m;
-                uint8_t *q;
-                if((charsdone%FONTBLOCK)==0) {
-                    void *tmp;
-                    long d;
-
-                    d=fchar- (font_pixmap.pixmap+sizeof(void*)*65536);
-                    tmp=realloc(font_pixmap.pixmap, sizeof(void*)*65536+
-                                (charsdone/FONTBLOCK+1)*FONTBLOCK*width*font_pixmap.height);
-                    if(tmp==NULL) {
-                        DBG(0, "Memory allocation issue. Only %d chars used.\n", charsdone);
-                        free(quadbits);
-                        return 0;
-                    }
-                    font_pixmap.pixmap = tmp;
-
-                    ftable=(void **)font_pixmap.pixmap;
-                    fchar=font_pixmap.pixmap+sizeof(void*)*65536+d;
-                }
-                ftable[j]=fchar;
-                for(k=0;k<fontheight;k++) {
-                    if(fontwidth>8) {
-                        q=(uint8_t *)&quadbits[(pix[k]>>8)&0xff];
-                        for(m=0;m<4;m++) *fchar++=*q++;
-                        q=(uint8_t *)&quadbits[pix[k]&0xff];
-                        for(m=0;m<width-4;m++) *fchar++=*q++;
-                    } else {
-                        q=(uint8_t *)&quadbits[pix[k]];
-                        for(m=0;m<width;m++) *fchar++=*q++;
-                    }
-                }
-                charsdone++;
-            }
+        if (font_pixmap.pixmap == NULL)
+            return -1;
+    }
+    if (load_fnt(font, cpb) == 0)
+        goto done;
+
+    fs.map = map_file(font, &fs.size);
+    if (fs.map == NULL) return -2;
+    if (index_hex()) {
+        free_font();
+        return -1;
+    }
+    if (bytesperchar == 1) {    /* only 256 glyphs, decode them now */
+        for (i = 0; i < 256; i++) {
+            e = find_glyph(cpb[i]);
+            if (e)
+                decode_hex(e, font_pixmap.pixmap + i*fs.bytes);
         }
+        free(fs.glyph);
+        fs.glyph = NULL;
+        fs.n = 0;
+        munmap(fs.map, fs.size);
+        fs.map = NULL;
+    }
+done:
+    if (bytesperchar == 2 && build_pages()) {
+        free_font();
+        return -1;
     }
-    if(charsdone<charstodo) DBG(0, "%d chars found.\n", charsdone);
-    free(quadbits);
     return 0;
 }
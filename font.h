@@ -1,4 +1,11 @@
 int init_font(const char *, const char *, int, int);
+uint8_t *font_glyph(int code);
 
 extern struct font font_pixmap;
 
+/* the font built into the program, see deffont.c */
+extern const char deffont_name[];
+extern const int deffont_width, deffont_height;
+extern const unsigned int deffont_size;
+extern const uint32_t deffont[];
+
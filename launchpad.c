@@ -46,6 +46,7 @@
 #include <unistd.h>
 #include <libgen.h>	/* dirname */
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <signal.h>
 
@@ -58,6 +59,10 @@
 #include "pixop.h"
 #include "font.h"
 #include "screen.h"
+#include "workpool.h"
+#include "control.h"
+#include "stats.h"
+#include "trace.h"
 
 int utf8_to_ucs2 (const unsigned char * input, const unsigned char ** end_ptr);
 
@@ -78,6 +83,19 @@ struct key_entry {
 	uint8_t ysteps;	/* if sym */
 };
 
+/*
+ * In terminal mode the key map is compiled into kmap[code][mods]:
+ * the bytes to send and the action to take for each key and each
+ * combination of the simulated modifiers.
+ */
+enum { M_SHIFT = 1, M_CTRL = 2, M_SYM = 4, M_FN = 8, M_LANG = 16, M_ALL = 32 };
+enum k_action { A_SEND = 0, A_SHIFT, A_CTRL, A_SYM, A_FN, A_LANG,
+	A_LANGLOCK, A_END, A_HELP, A_SCROLLUP, A_SCROLLDOWN };
+struct kmap {
+	char	seq[7];		/* nul terminated */
+	uint8_t	action;
+};
+
 /* each I/O channel has different name and fd for input and output */
 struct iodesc {
 	char *namein;
@@ -90,9 +108,18 @@ struct iodesc {
 struct terminal {
 	struct terminal *next;
 	struct sess *the_shell;
+	/* the pixels when the terminal was last shown, empty if not
+	 * usable, so switching back only draws the rows changed since.
+	 */
+	dynstr frame;
+	int frame_cur;		/* cursor in the saved frame */
 	char name[0]; 	/* dynamically allocated */
 };
 
+#define EVQ_LEN		64	/* input events handled per batch */
+#define WARM_MAX	4	/* spare shells */
+#define WARM_DELAY	2000	/* ms of idle before starting one */
+
 /*
  * Overall state for the launchpad.
  * The destructor must:
@@ -108,6 +135,7 @@ struct lp_state {
 	int		nentries;
 	struct key_entry e[256];	/* table of in/out events */
 	struct key_entry *by_code[256];	/* events by code */
+	struct kmap	*kmap[256];	/* M_ALL entries for known codes */
 
 	/* actions is a list of configured actions, pointing into the
 	 * [actions] section of the db.
@@ -124,25 +152,54 @@ struct lp_state {
 
 
 	int		refresh_delay;	/* screen refresh delay		*/
+	int		render_threads;	/* bands rendered in parallel	*/
+	int		predict;	/* local echo prediction	*/
+	int		warm_shells;	/* spare shells to keep ready	*/
+	int		bg_budget;	/* bytes parsed per wakeup, hidden */
+	int		lazy_parse;	/* bytes stored unparsed, hidden */
+	int		parse_threads;	/* a parser thread per terminal */
+	char		*ctl_path;	/* control socket, see control.c */
+	char		*trace_path;	/* trace dump, see trace.c	*/
 	struct iodesc	kpad, fw, vol, special;	/* names and descriptors	*/
 
+	/* input events drained from kpad, fw, vol, see read_input() */
+	struct input_event evq[EVQ_LEN];
+	int		nevq;
+	int		evq_sync;	/* evq[] up to here is complete */
+	int		dropping;	/* SYN_DROPPED seen, per device */
+	uint8_t		keys[3][32];	/* keys down, per device */
+	struct timeval	ev_time;	/* kernel time of the last event */
+
     int fontheight, fontwidth;
     int xofs, yofs;
+	char		*font, *encoding;	/* loaded by term_ready() */
+	int		font_ok;
 
 	/* fb, curterm, save_pixmap are either all set or all clear */
 	struct terminal *curterm;	/* current session		*/
 	fbscreen_t	*fb;		/* the framebuffer		*/
 	dynstr		save_pixmap;	/* saved pixmap			*/
 
-	/* various timeouts, nonzero if active */
-	struct timeval	screen_due;	/* next screen refresh		*/
+	/* what is on screen, to only draw the changes */
+	int		redraw;		/* next frame must draw all rows */
+	int		drawn_cur;	/* cursor in the last frame	*/
+	int		drawn_sb;	/* sb_pos in the last frame	*/
+	int		flush_all;	/* one update for the whole screen */
+
+	/* spare shells, started when idle and adopted by shell_find() */
+	struct sess	*warm[WARM_MAX];
+	int		nwarm;
+	int		warm_failed;	/* no more tries until a reload */
 
-	volatile int	got_signal;	/* changed by the handler */
+	/* various timeouts, nonzero if active */
+	struct timer	screen_timer;	/* next screen refresh		*/
+	struct timer	warm_timer;	/* next spare shell		*/
 
     int sb_lines, sb_pos, sb_step;
 
 	/* This area must be preserved on reinit */
 	int		savearea[0];	/* area below preserved on reinit */
+	struct sess	*sess;		/* our session, for the timers	*/
 	struct terminal *allterm;	/* all terminal sessions	*/
 	char		basedir[1024];
 	char		*cfg_name;		/* points into basedir */
@@ -336,34 +393,67 @@ static int setKey(const char *key, int *dst)
 	return (e ? 0 : 1);
 }
 
-/*
- * reinitialize.
- */
-static int launchpad_init(char *path)
+static void fd_close(int *fd)
 {
-	struct section *sec ;
-	int i;
-	struct key_entry *e;
-    char *encoding, *font;
+	if (*fd == -1)
+		return;
+	sess_watch(NULL, *fd, 0);
+	close(*fd);
+	*fd = -1;
+}
 
-	memset(lps, 0, (char *)&lps->savearea - (char *)lps);
-	/* load initial values */
-	lps->refresh_delay = 100;
-	lps->kpad.fdin = lps->fw.fdin = lps->vol.fdin = lps->special.fdin = -1;
-	if (path == NULL)
-		path = lps->cfg_name;
+static int same(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
 
-	lps->db = cfg_read(path, lps->basedir, NULL);
-	if ( lps->db == NULL) {
-		DBG(0, "%s -- not found or bad\n", path) ;
-		return -1 ;
+static int is_fifo(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * open the input and output of a channel. With the previous
+ * descriptor, fds whose name did not change are kept.
+ */
+static void io_open(struct iodesc *d, struct iodesc *old)
+{
+	if (old && same(d->namein, old->namein)) {
+		d->fdin = old->fdin;
+	} else {
+		if (old)
+			fd_close(&old->fdin);
+		d->fdin = d->namein ? open(d->namein, O_RDONLY | O_NONBLOCK) : -1;
+		if (d->fdin >= 0 && is_fifo(d->fdin)) {
+			/* with a writer of our own, no hangup when others close */
+			close(d->fdin);
+			d->fdin = open(d->namein, O_RDWR | O_NONBLOCK);
+		}
 	}
-	/* load file identifiers */
-	sec = cfg_find_section(lps->db, "Settings");
-	if (!sec) {
-		DBG(0, "section Settings not found\n") ;
-		return -1;
+	if (old && same(d->nameout, old->nameout)) {
+		d->fdout = old->fdout;
+	} else {
+		if (old)
+			fd_close(&old->fdout);
+		d->fdout = d->nameout ? open(d->nameout, O_WRONLY | O_NONBLOCK) : -1;
 	}
+}
+
+/*
+ * load the settings which do not depend on the key map,
+ * or their default if missing.
+ */
+static void read_settings(struct section *sec)
+{
+    char *encoding = NULL, *font = NULL;
+
+	lps->refresh_delay = 100;
+	lps->kpad.namein = lps->kpad.nameout = NULL;
+	lps->fw.namein = lps->fw.nameout = NULL;
+	lps->vol.namein = lps->vol.nameout = NULL;
+	lps->special.namein = lps->special.nameout = NULL;
 	/* load system-independent values */
 	setVal(sec, "RefreshDelay", 'i', &lps->refresh_delay);
 	setVal(sec, "KpadIn", 's', &lps->kpad.namein);
@@ -379,36 +469,174 @@ static int launchpad_init(char *path)
         symbols="!@#$%^&*()*+#-_()&!?~$|/\\\"':";
     }
 
-    setVal(sec, "Font", 's', &font);
+    if (setVal(sec, "Font", 's', &font)) {	/* the built in one */
+        font = (char *)deffont_name;
+        lps->fontheight = deffont_height;
+        lps->fontwidth = deffont_width;
+    } else {
+        if(setVal(sec, "FontHeight", 'i', &lps->fontheight)) lps->fontheight=16;
+        if(setVal(sec, "FontWidth", 'i', &lps->fontwidth)) lps->fontwidth=8;
+    }
     setVal(sec, "Encoding", 's', &encoding);
-    if(setVal(sec, "FontHeight", 'i', &lps->fontheight)) lps->fontheight=16;
-    if(setVal(sec, "FontWidth", 'i', &lps->fontwidth)) lps->fontwidth=8;
+    lps->font = font;
+    lps->encoding = encoding;
+    bytesperchar = (encoding == NULL || !strcmp(encoding, "UTF8")) ? 2 : 1;
     if(setVal(sec, "XOffset", 'i', &lps->xofs)) lps->xofs=0;
     if(setVal(sec, "YOffset", 'i', &lps->yofs)) lps->yofs=40;
     if(setVal(sec, "ScrollbackLines", 'i', &lps->sb_lines)) lps->sb_lines=0;
-    lps->sb_pos=0;
-    
+	if (setVal(sec, "RenderThreads", 'i', &lps->render_threads))
+		lps->render_threads = 1;
+	if (setVal(sec, "PredictEcho", 'i', &lps->predict))
+		lps->predict = 0;
+	if (setVal(sec, "WarmShells", 'i', &lps->warm_shells))
+		lps->warm_shells = 0;
+	if (lps->warm_shells > WARM_MAX)
+		lps->warm_shells = WARM_MAX;
+	if (setVal(sec, "BgParseBudget", 'i', &lps->bg_budget))
+		lps->bg_budget = 256;
+	if (setVal(sec, "LazyParse", 'i', &lps->lazy_parse))
+		lps->lazy_parse = 0;
+	if (setVal(sec, "ParseThreads", 'i', &lps->parse_threads))
+		lps->parse_threads = 0;
+	lps->ctl_path = NULL;
+	setVal(sec, "ControlSocket", 's', &lps->ctl_path);
+	lps->trace_path = "/var/tmp/myts.trace";
+	setVal(sec, "TraceFile", 's', &lps->trace_path);
+	if (setVal(sec, "TraceLevel", 'i', &trace_level))
+		trace_level = 1;
+}
 
-	/* try open files so we know on what system we are */
-	i = O_RDONLY | O_NONBLOCK;
-	lps->kpad.fdin	= open(lps->kpad.namein, i);
-	lps->fw.fdin	= open(lps->fw.namein, i);
-	lps->vol.fdin	= open(lps->vol.namein, i);
-	lps->special.fdin	= open(lps->special.namein, i);
-	DBG(2, "open %s %s %s gives %d %d %d\n",
-		lps->kpad.namein, lps->fw.namein, lps->vol.namein,
-		lps->kpad.fdin, lps->fw.fdin, lps->vol.fdin);
+/*
+ * What a key does in terminal mode with the modifiers in mods,
+ * used to build kmap[][]. Modifier keys get an action, other keys
+ * the bytes to send.
+ */
+static void translate(const struct key_entry *e, int code, int mods,
+	struct kmap *km)
+{
+	int shift = mods & M_SHIFT, ctrl = mods & M_CTRL;
+	int sym = mods & M_SYM, fn = mods & M_FN, lang = mods & M_LANG;
+	char *k = km->seq;
 
-	if (lps->kpad.fdin == -1 && lps->fw.fdin == -1 && lps->vol.fdin) {
-		DBG(0, "no input available, exiting...\n") ;
-		return -1;
+	memset(km, 0, sizeof(*km));
+#define E_IS(e, s) ((e)->namelen == strlen(s) && !strncasecmp((e)->name, s, (e)->namelen))
+	if (code == lps->term_end) {
+		km->action = (shift||fn||ctrl||sym) ? A_HELP : A_END;
+		return;
 	}
-	i = O_WRONLY | O_NONBLOCK;
-	lps->kpad.fdout	= open(lps->kpad.nameout, i) ;
-	lps->fw.fdout	= open(lps->fw.nameout, i);
-	lps->vol.fdout	= open(lps->vol.nameout, i);
-	/* ignore errors on output */
+	if (code == lps->term_shift)
+		km->action = A_SHIFT;
+	else if (code == lps->term_ctrl)
+		km->action = A_CTRL;
+	else if (code == lps->term_sym)
+		km->action = A_SYM;
+	else if (code == lps->term_fn)
+		km->action = A_FN;
+	else if (code == lps->term_lang)
+		km->action = shift ? A_LANGLOCK : A_LANG;
+	else if (code == lps->term_scrollup)
+		km->action = A_SCROLLUP;
+	else if (code == lps->term_scrolldown)
+		km->action = A_SCROLLDOWN;
+	else if (code == lps->term_home)
+		strcpy(k, shift ? "\eOF" : "\eOH"); // END or HOME
+	else if (fn) {
+		/* map chars into escape sequences */
+		int i;
+		char c = ' ';
+		if (e->namelen == 1)
+			c = e->name[0];
+		else if (E_IS(e, "Del"))
+			c = 'D';
+		for (i = 0; fnk[i]; i++) {
+			if (fnk[i][0] == c) {
+				strcpy(k, fnk[i]+1);
+				if (k[0] == '\t' && shift)
+					strcpy(k, "\e[Z"); // backtab
+				break;
+			}
+		}
+	} else if (sym) {
+		/* translate. The table contains the base characters,
+		 * symbols[] the mappings with SYM
+		 */
+		const char *t = "qwertyuiopasdfghjklDzxcvbnm.";
+		char *p;
+		if (e->namelen == 1)
+			k[0] = e->name[0];
+		else if (E_IS(e, "Del"))
+			k[0] = 'D';
+		p = index(t, k[0]);
+		if (k[0] && p != NULL) {
+			k[0] = symbols[p - t];
+			if (k[0] == '\t' && shift)
+				strcpy(k, "\e[Z"); // backtab
+		}
+	}
+	if (k[0])
+		return;
+	if (e->namelen == 1) {
+		k[0] = e->name[0];
+		if (isalpha(k[0])) {
+			if (shift) // shift overrides control
+				k[0] += 'A' - 'a';
+			else if (ctrl)
+				k[0] += 1 - 'a';
+		} else if (isdigit(k[0])) {
+			if (shift) // shift overrides control
+				k[0] = ")!@#$%^&*("[k[0] - '0'];
+			else if (ctrl)
+				k[0] += 1 - 'a';
+		}
+		if (lang) {
+			// Generate alt+key.
+			k[1] = k[0];
+			k[0] = '\e';
+		}
+	} else if (E_IS(e, "Enter"))
+		k[0] = 13;
+	else if (code == lps->term_esc)
+		k[0] = 0x1b;	/* escape */
+	else if (E_IS(e, "Space"))
+		k[0] = ' ';
+	else if (E_IS(e, "Del"))
+		k[0] = 0x7f;
+	else if (E_IS(e, "Up"))	/* PgUp if shift pressed */
+		strcpy(k, shift ? "\e[5~" : "\e[A");
+	else if (E_IS(e, "Down")) /* PgDown if shift pressed */
+		strcpy(k, shift ? "\e[6~" : "\e[B");
+	else if (E_IS(e, "Right"))
+		strcpy(k, "\e[C");
+	else if (E_IS(e, "Left"))
+		strcpy(k, "\e[D");
+}
 
+/* build kmap[][] from by_code[] and the Term* keys */
+static void compile_keymap(void)
+{
+	int code, mods;
+
+	for (code = 0; code < 256; code++) {
+		free(lps->kmap[code]);
+		lps->kmap[code] = NULL;
+		if (lps->by_code[code] == NULL)
+			continue;
+		lps->kmap[code] = calloc(M_ALL, sizeof(struct kmap));
+		if (lps->kmap[code] == NULL)
+			continue;
+		for (mods = 0; mods < M_ALL; mods++)
+			translate(lps->by_code[code], code, mods,
+				&lps->kmap[code][mods]);
+	}
+}
+
+/* build the key tables, and load the settings using key names */
+static void build_keymap(struct section *sec)
+{
+	struct key_entry *e;
+	int i;
+
+	lps->nentries = 0;
 	/* load keymap entries (system-dependent) */
 	build_seq(cfg_find_section(lps->db, "inkeys"));
 	build_seq(cfg_find_section(lps->db,
@@ -456,6 +684,9 @@ static int launchpad_init(char *path)
 	}
 
 	/* load parameters that depend on the key mapping */
+	lps->term_end = lps->term_esc = lps->term_ctrl = lps->term_shift = 0;
+	lps->term_sym = lps->term_fn = lps->term_lang = lps->term_home = 0;
+	lps->term_scrollup = lps->term_scrolldown = 0;
 	setVal(sec, "TermEnd", 'k', &lps->term_end);
 	setVal(sec, "TermEsc", 'k', &lps->term_esc);
 	setVal(sec, "TermCtrl", 'k', &lps->term_ctrl);
@@ -469,6 +700,8 @@ static int launchpad_init(char *path)
 	lps->xsym = 1;	/* position of initial symbol */
 	lps->ysym = 1;
 
+	lps->sym = lps->fw_left = lps->fw_right = lps->fw_up = 0;
+	lps->fw_down = lps->fw_select = lps->del = 0;
 	setKey("Sym", &lps->sym);
 	setKey("Left", &lps->fw_left);
 	setKey("Right", &lps->fw_right);
@@ -477,14 +710,11 @@ static int launchpad_init(char *path)
 	setKey("Select", &lps->fw_select);
 	setKey("Del", &lps->del);
 	setKey("Home", &lps->term_home);
+	compile_keymap();
+}
 
-    if (init_font(encoding, font, lps->fontheight, lps->fontwidth)) {
-        if(init_font("CP437.table", "unifont.hex", lps->fontheight, lps->fontwidth)) {
-            DBG(0, "No font found.\n") ;
-            return -1 ;
-        }
-    }
-
+static void lang_symbols(struct section *sec)
+{
     if(bytesperchar==1) {
         if(setVal(sec, "LangSymbols", 's', &langsymbols)) {
             langsymbols="qwertyuiopasdfghjklDzxcvbnm.";
@@ -511,9 +741,187 @@ static int launchpad_init(char *path)
         langsymbols16[i]=(unsigned char *)utf8syms;
         shiftlangsymbols16[i]=(unsigned char *)utf8shiftsyms;
     }
+}
+
+/*
+ * initialize.
+ */
+static int show_term(const char *name);
+static void ctl_query(dynstr *reply);
+static void ctl_stats(dynstr *reply);
+static const struct ctl_ops ctl_ops = {
+	.show = show_term,
+	.query = ctl_query,
+	.stats = ctl_stats,
+};
+
+static int launchpad_init(char *path)
+{
+	struct section *sec ;
+
+	memset(lps, 0, (char *)&lps->savearea - (char *)lps);
+	if (path == NULL)
+		path = lps->cfg_name;
+
+	lps->db = cfg_read(path, lps->basedir, NULL);
+	if ( lps->db == NULL) {
+		DBG(0, "%s -- not found or bad\n", path) ;
+		return -1 ;
+	}
+	boot_mark("config read");
+	/* load file identifiers */
+	sec = cfg_find_section(lps->db, "Settings");
+	if (!sec) {
+		DBG(0, "section Settings not found\n") ;
+		return -1;
+	}
+	read_settings(sec);
+
+	/* try open files so we know on what system we are */
+	io_open(&lps->kpad, NULL);
+	io_open(&lps->fw, NULL);
+	io_open(&lps->vol, NULL);
+	io_open(&lps->special, NULL);
+	DBG(2, "open %s %s %s gives %d %d %d\n",
+		lps->kpad.namein, lps->fw.namein, lps->vol.namein,
+		lps->kpad.fdin, lps->fw.fdin, lps->vol.fdin);
+
+	if (lps->kpad.fdin == -1 && lps->fw.fdin == -1 && lps->vol.fdin) {
+		DBG(0, "no input available, exiting...\n") ;
+		return -1;
+	}
+	/* ignore errors on output */
+	boot_mark("devices open");
+
+	build_keymap(sec);
+	boot_mark("keymap built");
+	lang_symbols(sec);
+	ctl_open(lps->ctl_path, &ctl_ops);
+	trace_file(lps->trace_path);
+	boot_mark("launchpad ready");
 	return 0 ;
 }
 
+/* hidden terminals parse little or nothing until shown */
+static void term_hide(struct sess *s, int hide)
+{
+	term_budget(s, hide ? lps->bg_budget : 0);
+	term_lazy(s, hide ? lps->lazy_parse : 0);
+	term_viewer(s, hide ? NULL : lps->sess);	/* draw its echo */
+}
+
+static void curterm_end(void);
+static void regrab(const struct lp_state *old);
+static void warm_free(void);
+static int term_ready(void);
+
+/*
+ * On SIGHUP read the config again and only redo what changed:
+ * devices are reopened if their name changed, and the font is
+ * reloaded if Font, Encoding or its size changed. Terminals and
+ * terminal mode are preserved. On errors the old config stays.
+ */
+static int launchpad_reload(void)
+{
+	static struct lp_state old;	/* the previous settings */
+	struct config *db;
+	struct section *sec;
+	struct terminal *t;
+	int font_changed, size_changed, i;
+
+	db = cfg_read(lps->cfg_name, lps->basedir, NULL);
+	sec = db ? cfg_find_section(db, "Settings") : NULL;
+	if (sec == NULL) {
+		DBG(0, "%s -- not found or bad, not reloaded\n", lps->cfg_name);
+		cfg_free(db);
+		return -1;
+	}
+	old = *lps;
+	lps->db = db;
+	read_settings(sec);
+	lps->warm_failed = 0;	/* spare shells may work now */
+	io_open(&lps->kpad, &old.kpad);
+	io_open(&lps->fw, &old.fw);
+	io_open(&lps->vol, &old.vol);
+	io_open(&lps->special, &old.special);
+	if (lps->curterm)	/* grab the reopened devices too */
+		regrab(&old);
+	ctl_open(lps->ctl_path, &ctl_ops);
+	trace_file(lps->trace_path);
+	build_keymap(sec);
+	lang_symbols(sec);
+
+	font_changed = !same(lps->font, old.font) ||
+		!same(lps->encoding, old.encoding) ||
+		lps->fontheight != old.fontheight ||
+		lps->fontwidth != old.fontwidth;
+	size_changed = font_changed || lps->xofs != old.xofs ||
+		lps->yofs != old.yofs || lps->sb_lines != old.sb_lines;
+	DBG(0, "reloaded, font %s, size %s\n", font_changed ? "changed" : "same",
+		size_changed ? "changed" : "same");
+	if (size_changed)
+		warm_free();
+	if (font_changed) {
+		lps->font_ok = 0;
+		/* saved frames use the old font */
+		for (t = lps->allterm; t; t = t->next)
+			ds_reset(t->frame);
+		if (lps->curterm && term_ready()) {
+			curterm_end();
+		} else if (lps->curterm) {
+			lps->redraw = 1;
+			lps->drawn_cur = -1;
+			timer_start(&lps->screen_timer, lps->sess, 0, 0);
+		}
+	}
+	if (lps->font_ok)	/* resize the pool if already in use */
+		lps->render_threads = pool_init(lps->render_threads);
+	if (lps->predict != old.predict) {
+		for (t = lps->allterm; t; t = t->next)
+			term_predict(t->the_shell, lps->predict);
+	}
+	if (lps->bg_budget != old.bg_budget ||
+	    lps->lazy_parse != old.lazy_parse) {
+		for (t = lps->allterm; t; t = t->next) {
+			if (t != lps->curterm)
+				term_hide(t->the_shell, 1);
+		}
+		for (i = 0; i < lps->nwarm; i++)
+			term_hide(lps->warm[i], 1);
+	}
+	if (lps->parse_threads != old.parse_threads) {
+		for (t = lps->allterm; t; t = t->next)
+			term_thread(t->the_shell, lps->parse_threads);
+		for (i = 0; i < lps->nwarm; i++)
+			term_thread(lps->warm[i], lps->parse_threads);
+	}
+	cfg_free(old.db);
+	return 0;
+}
+
+/*
+ * The font and the render threads are only needed in terminal
+ * mode, so they are set up on the first activation.
+ */
+static int term_ready(void)
+{
+	if (lps->font_ok)
+		return 0;
+    if (init_font(lps->encoding, lps->font, lps->fontheight, lps->fontwidth)) {
+        DBG(0, "cannot load %s, using %s\n", lps->font, deffont_name);
+        lps->fontheight = deffont_height;
+        lps->fontwidth = deffont_width;
+        if(init_font(lps->encoding, deffont_name, lps->fontheight, lps->fontwidth)) {
+            DBG(0, "No font found.\n") ;
+            return -1 ;
+        }
+    }
+	boot_mark("font loaded");
+	lps->render_threads = pool_init(lps->render_threads);
+	lps->font_ok = 1;
+	return 0;
+}
+
 struct terminal *shell_find(const char *name);
 
 /* block or unblock input events to the kindle.
@@ -532,11 +940,67 @@ static void capture_input(int capture)
     		perror("Capture k3_vol input:");
 }
 
+/* grab the input devices opened in place of those in old */
+static void regrab(const struct lp_state *old)
+{
+	const struct iodesc *d[] = { &lps->kpad, &lps->fw, &lps->vol };
+	const struct iodesc *o[] = { &old->kpad, &old->fw, &old->vol };
+	int i;
+
+	for (i = 0; i < sizeof(d) / sizeof(d[0]); i++) {
+		if (d[i]->fdin == -1 || same(d[i]->namein, o[i]->namein))
+			continue;
+		if (ioctl(d[i]->fdin, EVIOCGRAB, 1))
+			perror("Capture reopened input:");
+	}
+}
+
+/* keep the pixels of the current terminal to show it again quickly */
+static void save_frame(void)
+{
+	struct terminal *t = lps->curterm;
+	pixmap_t *p;
+
+	if (!t || !lps->fb)
+		return;
+	ds_reset(t->frame);
+	if (lps->redraw || lps->drawn_sb)	/* not the live screen */
+		return;
+	p = &lps->fb->pixmap;
+	ds_append(&t->frame, p->surface, p->width * p->height * p->bpp / 8);
+	t->frame_cur = lps->drawn_cur;
+}
+
+/* show a terminal, starting from its saved frame if there is one */
+static void show_frame(struct terminal *t)
+{
+	pixmap_t *p = &lps->fb->pixmap;
+	int l = p->width * p->height * p->bpp / 8;
+
+	if (lps->curterm && lps->curterm != t)
+		term_hide(lps->curterm->the_shell, 1);
+	term_hide(t->the_shell, 0);	/* parses what was stored */
+	lps->curterm = t;
+	lps->sb_pos = 0;
+	lps->drawn_sb = 0;
+	if (ds_len(t->frame) == l) {
+		memcpy(p->surface, ds_data(t->frame), l);
+		lps->redraw = 0;
+		lps->drawn_cur = t->frame_cur;
+	} else {
+		lps->redraw = 1;
+		lps->drawn_cur = -1;
+	}
+	lps->flush_all = 1;
+	process_screen();
+}
+
 static void curterm_end(void)
 {
 	int l = ds_len(lps->save_pixmap);
 
 	DBG(0, "exit from terminal mode\n");
+	save_frame();
 	if (l && lps->fb) {
 		pixmap_t *p = &lps->fb->pixmap;
 		memcpy(p->surface, ds_data(lps->save_pixmap), l);
@@ -544,6 +1008,8 @@ static void curterm_end(void)
 		fb_update_area(lps->fb, UMODE_PARTIAL, 0, 0, p->width, p->height, NULL);
 	}
 	fb_close(lps->fb);
+	if (lps->curterm)
+		term_hide(lps->curterm->the_shell, 1);
 	lps->curterm = NULL;
 	lps->fb = NULL;
 	capture_input(0);
@@ -555,153 +1021,63 @@ static void curterm_end(void)
 static void process_term(struct input_event *ev, int mode)
 {
 	char k[16];
-	struct key_entry *e = lps->by_code[ev->code];
-	/* simulate ctrl, shift, sym keys */
-	static int ctrl = 0;
-	static int shift = 0;
-	static int sym = 0;
-	static int fn = 0;
-	static int lang = 0;
+	const struct kmap *km = ev->code < 256 ? lps->kmap[ev->code] : NULL;
+	/* simulated ctrl, shift, sym, fn, lang keys */
+	static int mods = 0;
 	static int langlock = 0;
-	static int home = 0;
-	(void) home;
     static int help = 0;
 
-	DBG(1, "process event %d %d e %p %.*s for terminal\n",
-		ev->value, ev->code, e,
-		e ? e->namelen : 3, e ? e->name : "---");
-	if (e == NULL)	/* unknown event */
+	DBG(1, "process event %d %d km %p for terminal\n",
+		ev->value, ev->code, km);
+	if (km == NULL)	/* unknown event */
 		return;
-	memset(k, 0, sizeof(k));
+	k[0] = '\0';
 	if (ev->value == 1 || ev->value == 2) { /* press */
-#define E_IS(e, s) ((e)->namelen == strlen(s) && !strncasecmp((e)->name, s, (e)->namelen))
-		if (ev->code == lps->term_end) {
-            if(shift||fn||ctrl||sym) {
-                if(!help) print_keymap();
-                help=1;
-            }  else help=0;
+		km += mods | (langlock ? M_LANG : 0);
+		switch (km->action) {
+		case A_HELP:
+			if (!help)
+				print_keymap();
+			help = 1;
 			return;
-        }
-		if (ev->code == lps->term_shift)
-			shift = 1;
-		else if (ev->code == lps->term_ctrl)
-			ctrl = 1;
-		else if (ev->code == lps->term_sym)
-			sym = 1;
-		else if (ev->code == lps->term_fn)
-			fn = 1;
-		else if (ev->code == lps->term_lang) {
-            if(shift)
-                langlock = !langlock;
-            else lang = 1;
-        } 
-        else if (ev->code == lps->term_scrollup) {
+		case A_END:
+			help = 0;
+			return;
+		case A_SHIFT:	mods |= M_SHIFT;	break;
+		case A_CTRL:	mods |= M_CTRL;		break;
+		case A_SYM:	mods |= M_SYM;		break;
+		case A_FN:	mods |= M_FN;		break;
+		case A_LANG:	mods |= M_LANG;		break;
+		case A_LANGLOCK:
+			langlock = !langlock;
+			break;
+		case A_SCROLLUP:
 			lps->sb_pos += lps->sb_step;
-            process_screen();
-        }
-		else if (ev->code == lps->term_scrolldown) {
+			process_screen();
+			break;
+		case A_SCROLLDOWN:
 			lps->sb_pos -= lps->sb_step;
-            if (lps->sb_pos<0) lps->sb_pos=0;
-            process_screen();
-        }
-		else if (ev->code == lps->term_home) {
-            strcpy(k, shift ? "\eOF" : "\eOH"); // END or HOME
-            home = 1;
-        } 
-		else if (fn) {
-			/* map chars into escape sequences */
-			int i;
-			char c = ' ';
-			if (e->namelen == 1)
-				c = e->name[0];
-			else if (E_IS(e, "Del"))
-				c = 'D';
-			for (i = 0; fnk[i]; i++) {
-				if (fnk[i][0] == c) {
-					strcpy(k, fnk[i]+1);
-                    if (k[0] == '\t' && shift)
-                        strcpy(k, "\e[Z"); // backtab
-					break;
-				}
-			}
-			DBG(1, "function %s\n", k);
-		} 
-        else if (sym) {
-			/* translate. The first row in the table contains
-			 * the base characters, and the other
-			 * two are the mappings with SYM and SYM-SHIFT
-			 */
-			const char *t[] = { "qwertyuiopasdfghjklDzxcvbnm."};
-			char *p;
-			if (e->namelen == 1)
-				k[0] = e->name[0];
-			else if (E_IS(e, "Del"))
-				k[0] = 'D';
-//			else if (E_IS(e, "Sym"))
-//				k[0] = 'S';
-//			else if (E_IS(e, "Enter"))
-//				k[0] = 'E';
-			p = index(t[0], k[0]);
-			if ((p != NULL) && (p-t[0]<=27)) {
-                k[0] = symbols[p - t[0]];
-                if (k[0] == '\t' && shift)
-                    strcpy(k, "\e[Z"); // backtab
-            }
-		} 
-        if(!k[0]) {
-        if (e->namelen == 1) {
-			k[0] = e->name[0];
-			if (isalpha(k[0])) {
-				if (shift) // shift overrides control
-					k[0] += 'A' - 'a';
-				else if (ctrl)
-					k[0] += 1 - 'a';
-			} else if (isdigit(k[0])) {
-				if (shift) // shift overrides control
-					k[0] = ")!@#$%^&*("[k[0] - '0'];
-				else if (ctrl)
-					k[0] += 1 - 'a';
-			}
-			if (lang || langlock) {
-				// Generate alt+key.
-				k[1] = k[0];
-				k[0] = '\e';
-			}
-		} else if (E_IS(e, "Enter"))
-			k[0] = 13;
-        else if (ev->code == lps->term_esc)
-			k[0] = 0x1b;	/* escape */
-		else if (E_IS(e, "Space"))
-			k[0] = ' ';
-		else if (E_IS(e, "Del"))
-			k[0] = 0x7f;
-		else if (E_IS(e, "Up"))	/* PgUp if shift pressed */
-			strcpy(k, shift ? "\e[5~" : "\e[A");
-		else if (E_IS(e, "Down")) /* PgDown if shift pressed */
-			strcpy(k, shift ? "\e[6~" : "\e[B");
-		else if (E_IS(e, "Right"))
-			strcpy(k, "\e[C");
-		else if (E_IS(e, "Left"))
-			strcpy(k, "\e[D");
-        }
+			if (lps->sb_pos<0) lps->sb_pos=0;
+			process_screen();
+			break;
+		}
+		strcpy(k, km->seq);
 	} else if (ev->value == 0) { /* release */
-		if (ev->code == lps->term_end) {
-			if(help) process_screen() ; else curterm_end();
-            help=0;
+		switch (km->action) {
+		case A_END:
+			if (help) {
+				lps->redraw = 1;
+				process_screen();
+			} else
+				curterm_end();
+			help = 0;
 			return;
+		case A_SHIFT:	mods &= ~M_SHIFT;	break;
+		case A_CTRL:	mods &= ~M_CTRL;	break;
+		case A_SYM:	mods &= ~M_SYM;		break;
+		case A_FN:	mods &= ~M_FN;		break;
+		case A_LANG:	mods &= ~M_LANG;	break;
 		}
-		if (ev->code == lps->term_shift)
-			shift = 0;
-		else if (ev->code == lps->term_ctrl)
-			ctrl = 0;
-		else if (ev->code == lps->term_sym)
-			sym = 0;
-		else if (ev->code == lps->term_fn)
-			fn = 0;
-		else if (ev->code == lps->term_lang)
-			lang = 0;
-		else if (ev->code == lps->term_home)
-			home = 0;
 	}
     if(k[0] && lps->sb_pos) {
         lps->sb_pos=0;
@@ -712,11 +1088,21 @@ static void process_term(struct input_event *ev, int mode)
 }
 
 
+/* background byte for the attribute of a char */
+static int attr_bg(int attr)
+{
+	int bg = (attr & 0x38) >> 2 | (attr & 0x07); /* background color */
+
+	bg = (bg | (bg >> 1)) & 0x7; // Decrease intensity.
+	return bg | (bg << 4);
+}
+
 /*
- * print a buffer at x, y. If attr, use attributes array
- * Wrap after 'cols'.
+ * draw a buffer at x, y. If attr, use attributes array
+ * Wrap after 'cols'. Returns the height of the area drawn,
+ * the caller is responsible for updating the screen.
  */
-static void print_buf(int x0, int y0, int cols, int cur,
+static int draw_buf(int x0, int y0, int cols, int cur,
 	const uint8_t *buf, int len, const uint8_t *attr, int bg0)
 {
         int i, x = x0, y = y0;
@@ -725,14 +1111,10 @@ static void print_buf(int x0, int y0, int cols, int cur,
 
         for (i=0; i < len; i++) {
             int cc;
-            unsigned char bg = attr ? attr[i] : (bg0 << 2);
+            unsigned char bg = attr_bg(attr ? attr[i] : (bg0 << 2));
             if(bytesperchar==1) 
                 cc = buf[i];
             else cc = buf16[i];
-            bg = (bg & 0x38) >> 2 | (bg & 0x07); /* background color */
-
-            bg = (bg | (bg >> 1)) & 0x7; // Decrease intensity.
-            bg = bg | (bg << 4);
             if ( i == cur )
                 bg |= 0x88;
             get_char_pixmap(lps->fb->font, cc, &char_pixmap) ;
@@ -745,51 +1127,291 @@ static void print_buf(int x0, int y0, int cols, int cur,
             }
         }
         if(y==y0)y+=char_pixmap.height;
+	return y - y0;
+}
+
+/*
+ * print a buffer at x, y and update the screen area.
+ */
+static void print_buf(int x0, int y0, int cols, int cur,
+	const uint8_t *buf, int len, const uint8_t *attr, int bg0)
+{
+	int h = draw_buf(x0, y0, cols, cur, buf, len, attr, bg0);
+
+	stats.glyphs += len;
+
 	fb_update_area(lps->fb, UMODE_PARTIAL, x0, y0,
-		cols*(char_pixmap.width), y - y0, NULL) ;
+		cols*lps->fontwidth, h, NULL) ;
 	DBG(2, "end\n");
 }
 
+/*
+ * A frame is rendered in horizontal bands, one per render thread.
+ * Each band draws the rows flagged in todo[] within [first, last)
+ * and records the range actually drawn in [lo, hi).
+ * The screen is only updated after all bands are done.
+ */
+#define MAXBANDS	9
+
+struct band {
+	int first, last;	/* rows assigned to the band */
+	int lo, hi;		/* rows drawn, lo == hi if none */
+	int glyphs;		/* chars drawn, for the stats */
+};
+
+struct frame {
+	struct term_state st;
+	int sbrows;		/* rows at the top taken from scrollback */
+	uint8_t todo[MAX_ROWS];	/* display rows to draw */
+	int nbands;
+	struct band band[MAXBANDS];
+};
+
+/*
+ * draw chars [c0, c1) of page row 'row' at display row y.
+ * The blank tail of the row becomes a single rectangle fill,
+ * plus one more for the cursor if it is there.
+ * Returns the number of glyphs drawn.
+ */
+static int draw_span(const struct term_state *st, int y, int row,
+	int c0, int c1)
+{
+	int i, cur = -1, b = st->blank[row], c_first = c0, n = 0;
+	int x = lps->xofs + c0*lps->fontwidth;
+
+	y = lps->yofs + y*lps->fontheight;
+	if (st->cur >= 0 && st->cur / st->cols == row)
+		cur = st->cur % st->cols;
+	if (c0 < b) {
+		int e = (b < c1) ? b : c1;
+		i = row*st->cols + c0;
+		draw_buf(x, y, e - c0, (cur >= c0 && cur < e) ? cur - c0 : -1,
+			(uint8_t *)st->data + i*bytesperchar, e - c0,
+			(uint8_t *)st->attr + i, 0);
+		x += (e - c0)*lps->fontwidth;
+		n = e - c0;
+		c0 = e;
+	}
+	if (c0 < c1) {
+		int bg = attr_bg(st->blank_attr[row]);
+		pix_fill(&lps->fb->pixmap, x, y, (c1 - c0)*lps->fontwidth,
+			lps->fontheight, bg);
+		if (cur >= c0 && cur < c1)
+			pix_fill(&lps->fb->pixmap,
+				lps->xofs + cur*lps->fontwidth, y,
+				lps->fontwidth, lps->fontheight, bg | 0x88);
+	}
+	/* predicted chars go on top, on a light background */
+	for (i = 0; i < st->pred_len; i++) {
+		int p = st->pred_cur + i;
+		uint16_t c = st->pred[i];
+		uint8_t c8 = c, tentative = 1 << 3;
+
+		if (p / st->cols != row || p % st->cols < c_first ||
+		    p % st->cols >= c1)
+			continue;
+		draw_buf(lps->xofs + (p % st->cols)*lps->fontwidth, y, 1, -1,
+			bytesperchar == 1 ? &c8 : (uint8_t *)&c, 1,
+			&tentative, 0);
+		n++;
+	}
+	return n;
+}
+
+/* draw display row y of the frame, returns the glyphs drawn */
+static int draw_row(struct frame *f, int y)
+{
+	const struct term_state *st = &f->st;
+	int row;
+
+	if (y >= f->sbrows)
+		return draw_span(st, y, y - f->sbrows, 0, st->cols);
+	/* scrollback has no blank tails */
+	row = lps->sb_lines - lps->sb_pos + y;
+	draw_buf(lps->xofs, lps->yofs + y*lps->fontheight, st->cols,
+		-1, (uint8_t *)st->sb_data + row*st->cols*bytesperchar,
+		st->cols, (uint8_t *)st->sb_attr + row*st->cols, 0);
+	return st->cols;
+}
+
+/* pool callback, draw the dirty rows of band i */
+static void draw_band(void *arg, int i)
+{
+	struct frame *f = arg;
+	struct band *b = &f->band[i];
+	int y;
+
+	b->lo = b->hi = b->first;
+	b->glyphs = 0;
+	for (y = b->first; y < b->last; y++) {
+		if (!f->todo[y])
+			continue;
+		if (b->hi == b->lo)
+			b->lo = y;
+		b->glyphs += draw_row(f, y);
+		b->hi = y + 1;
+	}
+}
+
+/*
+ * The fast path: when the change since the last frame is a few chars
+ * on the cursor row, or just a cursor movement (typically the echo of
+ * a keystroke), draw only those chars plus the old and new cursor,
+ * and update the screen at once.
+ */
+#define FAST_CHARS	8	/* max chars changed for the fast path */
+
+static int small_change(const struct term_state *st)
+{
+	int row;
+
+	if (lps->redraw || lps->sb_pos || lps->drawn_sb)
+		return 0;
+	if (st->dmg_hi <= st->dmg_lo)	/* cursor only */
+		return 1;
+	row = st->dmg_lo / st->cols;
+	if (st->dmg_hi - st->dmg_lo > FAST_CHARS ||
+	    (st->dmg_hi - 1) / st->cols != row)
+		return 0;
+	return st->cur < 0 || st->cur / st->cols == row ||
+		(lps->drawn_cur >= 0 && lps->drawn_cur / st->cols == row);
+}
+
+/* draw chars [lo, hi) of the page, all on the same row */
+static void draw_chars(const struct term_state *st, int lo, int hi)
+{
+	int row = lo / st->cols;
+
+	stats.glyphs += draw_span(st, row, row, lo % st->cols,
+		(hi - 1) % st->cols + 1);
+}
+
+static void fast_frame(const struct term_state *st)
+{
+	int r[3][2], n = 0, i, pagelen = st->rows*st->cols;
+	int top = st->rows, bottom = 0;
+
+	if (st->dmg_hi > st->dmg_lo) {
+		r[n][0] = st->dmg_lo;
+		r[n++][1] = st->dmg_hi;
+	}
+	if (lps->drawn_cur != st->cur) {
+		if (lps->drawn_cur >= 0 && lps->drawn_cur < pagelen) {
+			r[n][0] = lps->drawn_cur;
+			r[n++][1] = lps->drawn_cur + 1;
+		}
+		if (st->cur >= 0 && st->cur < pagelen) {
+			r[n][0] = st->cur;
+			r[n++][1] = st->cur + 1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		draw_chars(st, r[i][0], r[i][1]);
+		if (r[i][0] / st->cols < top)
+			top = r[i][0] / st->cols;
+		if (r[i][0] / st->cols > bottom)
+			bottom = r[i][0] / st->cols;
+	}
+	if (n == 0)
+		return;
+	if (bottom - top <= 1) {	/* a single update for all */
+		int lo = st->cols, hi = 0;
+		for (i = 0; i < n; i++) {
+			if (r[i][0] % st->cols < lo)
+				lo = r[i][0] % st->cols;
+			if ((r[i][1] - 1) % st->cols + 1 > hi)
+				hi = (r[i][1] - 1) % st->cols + 1;
+		}
+		fb_update_area(lps->fb, UMODE_PARTIAL,
+			lps->xofs + lo*lps->fontwidth,
+			lps->yofs + top*lps->fontheight,
+			(hi - lo)*lps->fontwidth,
+			(bottom - top + 1)*lps->fontheight, NULL);
+		return;
+	}
+	for (i = 0; i < n; i++) {	/* far apart, one each */
+		fb_update_area(lps->fb, UMODE_PARTIAL,
+			lps->xofs + (r[i][0] % st->cols)*lps->fontwidth,
+			lps->yofs + (r[i][0] / st->cols)*lps->fontheight,
+			(r[i][1] - r[i][0])*lps->fontwidth, lps->fontheight,
+			NULL);
+	}
+}
+
 /*
  * update the screen. We know the state is 'modified' so we
  * don't need to read it, just notify it and fetch data.
- * XXX to optimize the code we could store a copy of the prev
- * window so we only update smaller regions of the screen.
+ * Only rows flagged dirty by the terminal, plus the rows with the
+ * old and new cursor, are drawn; a full redraw is forced when the
+ * terminal is first shown, after an overlay, and in scrollback mode.
  */
 void process_screen(void)
 {
-	struct term_state st = { .flags = TS_MOD, .modified = 0};
-	uint8_t *d, *a;
-    int r;
+	static struct frame f;
+	struct term_state *st = &f.st;
+	int i, y, rows_per_band, full = 0, fast = 0;
+	uint64_t glyphs = stats.glyphs;
 
-    r=0;
-
-	timerclear(&lps->screen_due);
+	timer_stop(&lps->screen_timer);
 	if (!lps->curterm || !lps->fb)
 		return;
-	term_state(lps->curterm->the_shell, &st);
+	memset(st, 0, sizeof(*st));
+	st->flags = TS_MOD;
+	term_state(lps->curterm->the_shell, st);
 
-DBG(1, "st.top = %i   sb_pos = %i\n", st.top, lps->sb_pos);
-    if(lps->sb_pos>st.top)lps->sb_pos = st.top;
+DBG(1, "st.top = %i   sb_pos = %i\n", st->top, lps->sb_pos);
+	if(lps->sb_pos>st->top)lps->sb_pos = st->top;
 
-    if(lps->sb_pos) {
-        if (lps->sb_pos>=st.rows) {
-            r=st.rows;
-        } else {
-            r=lps->sb_pos;
-        }
-        print_buf(lps->xofs, lps->yofs, st.cols, -1, 
-                    (uint8_t *)st.sb_data+(lps->sb_lines-lps->sb_pos)*st.cols*bytesperchar, r * st.cols,
-		            (uint8_t *)st.sb_attr+(lps->sb_lines-lps->sb_pos)*st.cols, 0);
-    } 
-    if(r<st.rows){
+	if (small_change(st) && !lps->flush_all) {
+		fast_frame(st);
+		fast = 1;
+		goto done;
+	}
+	f.sbrows = lps->sb_pos >= st->rows ? st->rows : lps->sb_pos;
+	full = lps->redraw || lps->sb_pos || lps->drawn_sb;
+	for (y = 0; y < st->rows; y++)
+		f.todo[y] = full || (y >= f.sbrows && st->dirty[y - f.sbrows]);
+	if (!full && lps->drawn_cur != st->cur) {
+		if (lps->drawn_cur >= 0 && lps->drawn_cur < st->rows*st->cols)
+			f.todo[lps->drawn_cur / st->cols] = 1;
+		if (st->cur >= 0 && st->cur < st->rows*st->cols)
+			f.todo[st->cur / st->cols] = 1;
+	}
 
-        d = (unsigned char *)st.data;
-        a = (unsigned char *)st.attr;
+	/* split the rows in bands, the first ones take the remainder */
+	f.nbands = lps->render_threads;
+	if (f.nbands > st->rows)
+		f.nbands = st->rows;
+	rows_per_band = st->rows / f.nbands;
+	for (y = 0, i = 0; i < f.nbands; i++) {
+		f.band[i].first = y;
+		y += rows_per_band + (i < st->rows % f.nbands);
+		f.band[i].last = y;
+	}
+	pool_run(f.nbands, draw_band, &f);
 
-        print_buf(lps->xofs, lps->yofs + r*lps->fontheight, st.cols, st.cur, d, (st.rows-r) * st.cols,
-            a, 0);
-    }
+	for (i = 0; i < f.nbands; i++)
+		stats.glyphs += f.band[i].glyphs;
+	for (i = 0; i < f.nbands && !lps->flush_all; i++) {
+		struct band *b = &f.band[i];
+		if (b->hi == b->lo)
+			continue;
+		fb_update_area(lps->fb, UMODE_PARTIAL,
+			lps->xofs, lps->yofs + b->lo*lps->fontheight,
+			st->cols*lps->fontwidth, (b->hi - b->lo)*lps->fontheight,
+			NULL);
+	}
+done:
+	if (lps->flush_all) {
+		pixmap_t *p = &lps->fb->pixmap;
+		fb_update_area(lps->fb, UMODE_PARTIAL, 0, 0, p->width, p->height, NULL);
+		lps->flush_all = 0;
+	}
+	TRACE(1, TR_FRAME, fast, full, stats.glyphs - glyphs);
+	memset(st->dirty, 0, st->rows);
+	lps->drawn_cur = st->cur;
+	lps->drawn_sb = lps->sb_pos;
+	lps->redraw = 0;
 }
 
 void print_buf8(int x0, int y0, int cols, int cur,
@@ -808,11 +1430,13 @@ void print_buf8(int x0, int y0, int cols, int cur,
 void print_keymap() {
     unsigned char buf[65];
     int i, j;
+    const char *keys = "qwertyuiopasdfghjklDzxcvbnm.";
     struct term_state st = { .flags = TS_MOD, .modified = 0};
-	timerclear(&lps->screen_due);
+	timer_stop(&lps->screen_timer);
 	if (!lps->curterm || !lps->fb)
 		return;
 	term_state(lps->curterm->the_shell, &st);
+	lps->redraw = 1;	/* the next frame must cover the overlay */
 
     print_buf8(0, lps->yofs+lps->fontheight*1, st.cols, -1, (unsigned char *)"    q     w     e     r     t     y     u     i     o     p     ",64 , NULL, 0);
     print_buf8(0, lps->yofs+lps->fontheight*4, st.cols, -1, (unsigned char *)"    a     s     d     f     g     h     j     k     l     D     ",64 , NULL, 0);
@@ -824,15 +1448,24 @@ void print_keymap() {
     for(j=0;j<30;j+=10) {
         memset(buf,' ',64);
         for(i=0;i<(j==20?8:10);i++) { 
-            buf[i*6+3] = symbols[j+i];
-            if(fnk[j+i][1]=='\033') {
+            /* what the key sends with Sym and Fn, from kmap[][] */
+            struct key_entry *e = keys[j+i] == 'D' ?
+                lookup_key("Del", 3) : lookup_key(keys+j+i, 1);
+            const struct kmap *km = e ? lps->kmap[e->code] : NULL;
+            const char *fs;
+            if (km == NULL)
+                continue;
+            buf[i*6+3] = km[M_SYM].seq[0] ? km[M_SYM].seq[0] : ' ';
+            fs = km[M_FN].seq;
+            if(fs[0]=='\033') {
                 buf[i*6+5]='F';
-                buf[i*6+6]=fnk[j+i][4];
+                buf[i*6+6]=fs[3];
                 if(buf[i*6+6]>'5')buf[i*6+6]--;
-                if(fnk[j+i][3]=='2') {
-                    buf[i*6+6]="9a bc"[fnk[j+i][4]-'0'];
+                if(fs[2]=='2') {
+                    buf[i*6+6]="9a bc"[fs[3]-'0'];
                 }
-            } else buf[i*6+5]=fnk[j+i][1];
+            } else if (fs[0])
+                buf[i*6+5]=fs[0];
         }
         print_buf8(0, lps->yofs+lps->fontheight*(2+(j/10)*3), st.cols, -1, buf, 64 , NULL, 0);
     }
@@ -840,6 +1473,69 @@ void print_keymap() {
 }
 
 
+/*
+ * show the named terminal, creating it and entering terminal mode
+ * if needed. Returns 0 on success.
+ */
+static int show_term(const char *name)
+{
+	struct terminal *t;
+
+	if (term_ready())
+		return -1;
+	if (lps->curterm)	/* switching terminal */
+		save_frame();
+	else
+		lps->fb = fb_open();	/* also mark terminal mode */
+	if (lps->fb == NULL)
+		return -1;
+	t = shell_find(name);
+	DBG(0, "start %s got %p\n", name, t);
+	if (t) {
+		struct term_state st = { .flags = 0 };
+
+		term_state(t->the_shell, &st);
+		TRACE(0, TR_SHOW, t->the_shell->fd, st.rows, st.cols);
+	}
+	if (t == NULL) {
+		if (!lps->curterm) {
+			fb_close(lps->fb);
+			lps->fb = NULL;
+		}
+		return -1;
+	}
+	if (!lps->curterm) {	/* input is for us from now */
+		pixmap_t *pix = &lps->fb->pixmap;
+		int l = pix->width * pix->height * pix->bpp / 8;
+		ds_reset(lps->save_pixmap);
+		ds_append(&lps->save_pixmap, pix->surface, l);
+		capture_input(1) ;
+	}
+	show_frame(t);
+	return 0;
+}
+
+/* the Q command of the control socket */
+static void ctl_query(dynstr *reply)
+{
+	struct terminal *t;
+	struct term_state st;
+
+	for (t = lps->allterm; t; t = t->next) {
+		st.flags = 0;
+		term_state(t->the_shell, &st);
+		dsprintf(reply, "%s %d %d%s\n", t->name, st.rows, st.cols,
+			t == lps->curterm ? " *" : "");
+	}
+}
+
+/* the S command of the control socket, also printed on SIGUSR1 */
+static void ctl_stats(dynstr *reply)
+{
+	stats_dump(reply);
+	term_stats(reply);
+}
+
 /*
  * Process an input event from the kindle. 'mode' is the source
  */
@@ -852,23 +1548,7 @@ static void process_event(struct input_event *ev, int mode)
         char *buf = (char *)ev;
         if(buf[0]=='A') {
             buf[2]='\0';
-			lps->fb = fb_open();	/* also mark terminal mode */
-			struct terminal *t = shell_find(buf);
-			DBG(0, "start %s got %p\n", buf, t);
-			if (t == NULL) {
-                fb_close(lps->fb);
-				return;
-            }
-			if (lps->fb) {	/* if success, input is for us */
-				pixmap_t *pix = &lps->fb->pixmap;
-				int l = pix->width * pix->height * pix->bpp / 8;
-				lps->curterm = t;
-				ds_reset(lps->save_pixmap);
-				ds_append(&lps->save_pixmap, pix->surface, l);
-				capture_input(1) ;
-				// set a timeout to popup the terminal
-				gettimeofday(&lps->screen_due, NULL);
-            }
+            show_term(buf);
         }
 
         return;
@@ -890,22 +1570,106 @@ static void process_event(struct input_event *ev, int mode)
 	}
 }
 
-static void hup_handler(int x)
+/* pass the queued events of device src to process_event() */
+static void input_flush(int src)
 {
-	lps->got_signal = 1 ; /* reinit */
+	struct input_event *ev;
+	int i;
+
+	for (i = 0, ev = lps->evq; i < lps->nevq; i++, ev++) {
+		if (ev->type == EV_KEY && ev->code < 256) {
+			uint8_t *b = &lps->keys[src][ev->code / 8];
+			if (ev->value)
+				*b |= 1 << (ev->code % 8);
+			else
+				*b &= ~(1 << (ev->code % 8));
+			lps->ev_time = ev->time;
+		}
+		process_event(ev, src);
+	}
+	lps->nevq = lps->evq_sync = 0;
 }
 
-static void int_handler(int x)
+/*
+ * after SYN_DROPPED, queue a press or release for the keys whose
+ * state differs from what we have seen.
+ */
+static void input_resync(int src, int fd)
 {
-	lps->got_signal = 2 ; /* exit */
+	uint8_t cur[KEY_MAX/8 + 1];
+	int code;
+
+	memset(cur, 0, sizeof(cur));
+	if (ioctl(fd, EVIOCGKEY(sizeof(cur)), cur) < 0)
+		return;
+	for (code = 0; code < 256; code++) {
+		int down = (cur[code / 8] >> (code % 8)) & 1;
+		struct input_event *ev;
+
+		if (down == ((lps->keys[src][code / 8] >> (code % 8)) & 1))
+			continue;
+		if (lps->nevq == EVQ_LEN)
+			input_flush(src);
+		ev = lps->evq + lps->nevq++;
+		memset(ev, 0, sizeof(*ev));
+		gettimeofday(&ev->time, NULL);
+		ev->type = EV_KEY;
+		ev->code = code;
+		ev->value = down;
+		DBG(0, "resync code %d down %d\n", code, down);
+	}
+	lps->evq_sync = lps->nevq;
 }
 
-static void fd_close(int *fd)
+/*
+ * read all pending events from an evdev device and process them.
+ * Events are committed at SYN_REPORT; after a SYN_DROPPED the
+ * incomplete packet and the rest of it are discarded, and the key
+ * state is read back from the kernel. Returns the events read.
+ */
+static int read_input(int src, int fd)
 {
-	if (*fd == -1)
-		return;
-	close(*fd);
-	*fd = -1;
+	struct input_event buf[16];
+	int i, n, tot = 0;
+
+	do {
+		n = read(fd, buf, sizeof(buf));
+		if (n < (int)sizeof(buf[0]))
+			break;	/* EAGAIN or error */
+		n /= sizeof(buf[0]);
+		tot += n;
+		for (i = 0; i < n; i++) {
+			struct input_event *ev = buf + i;
+
+			if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+				/* deliver what is complete, evq is per src */
+				lps->nevq = lps->evq_sync;
+				input_flush(src);
+				lps->dropping |= 1 << src;
+				continue;
+			}
+			if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+				if (lps->dropping & (1 << src)) {
+					lps->dropping &= ~(1 << src);
+					input_resync(src, fd);
+				}
+				lps->evq_sync = lps->nevq;
+				continue;
+			}
+			if (lps->dropping & (1 << src))
+				continue;
+			TRACE(3, TR_KEY, src, ev->code, ev->value);	/* passwords too */
+			if (lps->nevq == EVQ_LEN)
+				input_flush(src);
+			lps->evq[lps->nevq++] = *ev;
+		}
+	} while (n == sizeof(buf)/sizeof(buf[0]));	/* short read: empty */
+	/* also deliver events from devices that never send SYN_REPORT,
+	 * while dropping there are none.
+	 */
+	input_flush(src);
+	DBG(2, "got %d events from %d\n", tot, fd);
+	return tot;
 }
 
 static void free_terminals(void)
@@ -917,6 +1681,7 @@ static void free_terminals(void)
 	while ( (t = lps->allterm) ) {
 		lps->allterm = t->next;
 		term_kill(t->the_shell, 9);
+		ds_free(t->frame);
 		free(t);
 	}
 }
@@ -931,6 +1696,7 @@ void term_dead(struct sess *s)
 		*t = cur->next;
 		if (lps->curterm == cur)
 			curterm_end();
+		ds_free(cur->frame);
 		memset(cur, 0, sizeof(*cur));
 		free(cur);
 		return;
@@ -938,32 +1704,113 @@ void term_dead(struct sess *s)
 	DBG(0, "could not find dead terminal %p\n", s);
 }
 
+/* the size of a terminal filling the screen */
+static int shell_size(int *rows, int *cols)
+{
+	fbscreen_t *fb = lps->fb ? lps->fb : fb_open();
+
+	if (fb == NULL)
+		return -1;
+	*rows = (fb->pixmap.height-2*lps->yofs)/lps->fontheight;
+	*cols = (fb->pixmap.width-2*lps->xofs)/lps->fontwidth;
+	if (fb != lps->fb)	/* only probed */
+		fb_close(fb);
+	return 0;
+}
+
+static void warm_dead(struct sess *s)
+{
+	int i;
+
+	for (i = 0; i < lps->nwarm; i++) {
+		if (lps->warm[i] == s) {
+			lps->warm[i] = lps->warm[--lps->nwarm];
+			return;
+		}
+	}
+}
+
+/* start a spare shell, so it has a prompt when it is needed */
+static void warm_spawn(void)
+{
+	int rows, cols;
+	struct sess *s;
+
+	if (shell_size(&rows, &cols))
+		return;
+	s = term_new("/bin/sh", "", rows, cols, lps->sb_lines, warm_dead);
+	if (s) {
+		term_hide(s, 1);
+		term_thread(s, lps->parse_threads);
+		lps->warm[lps->nwarm++] = s;
+	} else
+		lps->warm_failed = 1;	/* e.g. no ptys, do not retry */
+	DBG(1, "spare shell %p, %d ready\n", s, lps->nwarm);
+}
+
+/* take a spare shell of the right size, if any */
+static struct sess *warm_take(int rows, int cols)
+{
+	struct term_state st = { .flags = 0 };
+	struct sess *s;
+
+	while (lps->nwarm > 0) {
+		s = lps->warm[--lps->nwarm];
+		term_state(s, &st);
+		if (st.rows == rows && st.cols == cols)
+			return s;
+		term_kill(s, 9);	/* stale geometry */
+	}
+	return NULL;
+}
+
+static void warm_free(void)
+{
+	while (lps->nwarm > 0)
+		term_kill(lps->warm[--lps->nwarm], 9);
+	timer_stop(&lps->warm_timer);
+}
+
 /*
  * find or create a shell with the given name. The name string
  * is copied in the descriptor so it can be preserved on reboots.
+ * A spare shell is used if there is one.
  */
 struct terminal *shell_find(const char *name)
 {
 	struct terminal *t;
 	int l = strlen(name) + 1;
+	int rows, cols;
 
 	for (t = lps->allterm; t; t = t->next) {
 		if (!strcmp(name, t->name))
 			return t;
 	}
+	if (shell_size(&rows, &cols))
+		return NULL;
 	t = calloc(1, sizeof(*t) + l);
 	if (!t) {
 		DBG(0, "could not allocate session for %s\n", name);
 		return t;
 	}
 	strcpy(t->name, name);
-	t->the_shell = term_new("/bin/sh", t->name, (lps->fb->pixmap.height-2*lps->yofs)/lps->fontheight, 
-            (lps->fb->pixmap.width-2*lps->xofs)/lps->fontwidth, lps->sb_lines, term_dead);
-    lps->sb_step = (lps->fb->pixmap.height-2*lps->yofs)/lps->fontheight/2;
+	t->the_shell = warm_take(rows, cols);
+	if (t->the_shell) {
+		struct term_state st = { .flags = TS_NAME | TS_CB,
+			.name = t->name, .cb = term_dead };
+		term_state(t->the_shell, &st);
+	} else {
+		t->the_shell = term_new("/bin/sh", t->name, rows, cols,
+			lps->sb_lines, term_dead);
+		term_thread(t->the_shell, lps->parse_threads);
+	}
+	lps->sb_step = rows/2;
 	if (!t->the_shell) {
 		free(t);
 		return NULL;
 	}
+	term_predict(t->the_shell, lps->predict);
+	term_hide(t->the_shell, 1);	/* until shown */
 	t->next = lps->allterm;
 	lps->allterm  = t;
 	return t;
@@ -976,16 +1823,24 @@ struct terminal *shell_find(const char *name)
 static void launchpad_deinit(int restart)
 {
 	DBG(0, "called, restart %d\n", restart);
-	lps->got_signal = 0 ;
 	// XXX should remove the pending sessions from the scheduler ?
 	curterm_end();
 
-	signal(SIGINT, SIG_DFL) ;
-	signal(SIGTERM, SIG_DFL) ;
-	signal(SIGHUP, SIG_DFL) ;
+	sess_signal(NULL, SIGINT);
+	sess_signal(NULL, SIGTERM);
+	sess_signal(NULL, SIGHUP);
+	sess_signal(NULL, SIGUSR1);
+	sess_signal(NULL, SIGUSR2);
 
-	if (!restart)
+	warm_free();	/* the settings may change */
+	timer_stop(&lps->screen_timer);	/* the state is cleared */
+	memset(lps->by_code, 0, sizeof(lps->by_code));
+	compile_keymap();	/* only frees the tables */
+	if (!restart) {
 		free_terminals();
+		pool_free();
+		ctl_open(NULL, NULL);
+	}
 	fd_close(&lps->kpad.fdin);
 	fd_close(&lps->fw.fdin);
 	fd_close(&lps->vol.fdin);
@@ -1003,8 +1858,8 @@ static void launchpad_deinit(int restart)
 int launchpad_start(void);
 
 /*
- * callback for select.
- * We have only one session so ignore _s
+ * callback for the main loop. We have only one session, which is
+ * SF_POLL so it runs on every loop and notices the shell output.
  */
 int handle_launchpad(void *_s, struct cb_args *a)
 {
@@ -1025,50 +1880,65 @@ int handle_launchpad(void *_s, struct cb_args *a)
 		/* create screen refresh timeout if needed */
 		if (lps->fb && lps->curterm &&
 			    term_state(lps->curterm->the_shell, NULL) &&
-			    !timerisset(&lps->screen_due))
-			timeradd_ms(&a->now, lps->refresh_delay, &lps->screen_due);
-		/* Record pending timeouts */
-		timersetmin(&a->due, &lps->screen_due);
-		/* if we have keys to send, ignore input events */
-		for (i=0; i < sizeof(fds)/sizeof(fds[0]); i++) {
-			if (fds[i] >= 0)
-				FD_SET(fds[i], a->r);
-			if (fds[i] > a->maxfd)
-				a->maxfd = fds[i];
-		}
-		return 1;
+			    !timer_armed(&lps->screen_timer))
+			timer_start(&lps->screen_timer, _s, lps->refresh_delay, 0);
+		/* spare shells are started after some idle time */
+		if (lps->nwarm < lps->warm_shells && !lps->warm_failed &&
+			    !timer_armed(&lps->warm_timer))
+			timer_start(&lps->warm_timer, _s, WARM_DELAY, 0);
+		/* the devices may have been reopened, fd_close() unwatches */
+		for (i=0; i < sizeof(fds)/sizeof(fds[0]); i++)
+			sess_watch(_s, fds[i], SESS_READ);
+		sess_watch(_s, lps->special.fdin, SESS_READ);
+		return 0;
 	}
 
-	if (lps->got_signal == 1) {
-		launchpad_deinit(1);
-		launchpad_start();
-		return 0;
+	if (sig_fired(SIGUSR1)) {	/* the startup timeline, counters */
+		dynstr d = NULL;
+
+		boot_dump(stderr);
+		ctl_stats(&d);
+		fputs(ds_data(d), stderr);
+		ds_free(d);
 	}
-	if (lps->got_signal == 2) {
+	if (sig_fired(SIGUSR2))
+		trace_dump();
+	if (sig_fired(SIGHUP))
+		launchpad_reload();
+	if (sig_fired(SIGINT) | sig_fired(SIGTERM)) {
 		launchpad_deinit(0);
 		return 0;
 	}
+	if (timer_fired(&lps->warm_timer))
+		warm_spawn();
 	ev = 0;
 	if (1) {
 		struct input_event kbbuf[2];
 		for (j = 0; j < sizeof(fds) / sizeof(fds[0]) ; j++) {
-			int l = sizeof(struct input_event);
-			int n;
-			if (fds[j] < 0 || !FD_ISSET(fds[j], a->r))
+			if (!(sess_ready(fds[j]) & SESS_READ))
 				continue;
 			ev = 1;	/* got an event */
+			timer_stop(&lps->warm_timer);	/* not idle */
 			DBG(1, "reading on %d\n", fds[j]);
-			n = read(fds[j], kbbuf, l* 2) ;
-			DBG(2, "got %d bytes from %d\n", n, fds[j]);
-			for (i = 0; i < 2 && n >= l; i++, n -= l) {
-				process_event(kbbuf + i, j) ;
-			}
+			read_input(j, fds[j]);
 		}
-        if (read(lps->special.fdin, kbbuf, sizeof(struct input_event))>0) {
+        /* old style commands, see control.c for the socket */
+        while ((sess_ready(lps->special.fdin) & SESS_READ) &&
+		    read(lps->special.fdin, kbbuf, sizeof(struct input_event))>0) {
             process_event(kbbuf, -3); /* special mode */
         }
 	}
-	if (timerdue(&lps->screen_due, &a->now)) {
+	if (lps->fb && lps->curterm &&
+		    term_state(lps->curterm->the_shell, NULL)) {
+		/* small changes, e.g. echo, go out without waiting */
+		struct term_state st = { .flags = 0 };
+		term_state(lps->curterm->the_shell, &st);
+		if (small_change(&st)) {
+			process_screen();
+			return 0;
+		}
+	}
+	if (timer_fired(&lps->screen_timer)) {
 		process_screen();
 		return 0;
 	}
@@ -1109,10 +1979,14 @@ int launchpad_parse(int *ac, char *av[])
 
 int launchpad_start(void)
 {
-	new_sess(sizeof(struct sess), -2, handle_launchpad, NULL);
-	signal(SIGINT, int_handler);
-	signal(SIGTERM, int_handler);
-	signal(SIGHUP, hup_handler);
+	lps->sess = new_sess(sizeof(struct sess), -2, handle_launchpad, NULL);
+	stats_name(handle_launchpad, "launchpad");
+	lps->sess->prio = SP_INPUT;	/* keys before shell output */
+	sess_signal(lps->sess, SIGINT);
+	sess_signal(lps->sess, SIGTERM);
+	sess_signal(lps->sess, SIGHUP);	/* reload */
+	sess_signal(lps->sess, SIGUSR1);
+	sess_signal(lps->sess, SIGUSR2);	/* write the trace */
 	process_event(NULL, 0);	/* reset args */
 	if (!launchpad_init(NULL))
 		return 0;
@@ -32,11 +32,21 @@ routine and a pointer to app-specific data.
 Each application is then expected to record handlers that are called before
 and after a select() to define which descriptors to poll, and when
 a timeout is due.
+Sessions can instead register their descriptors once with sess_watch(),
+which uses epoll when available, and their timers with timer_start(),
+and are then only called when they have work to do.
 
  */
 
 #include "myts.h"
+#include "stats.h"
+#include "trace.h"
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 int verbose;
 struct my_args __me;
@@ -69,11 +79,470 @@ int timerdue(const struct timeval *dst, const struct timeval *now)
         return (timerisset(dst) && timercmp(dst, now, <=));
 }
 
+/*
+ * Startup timeline: boot_mark() records when each phase ends,
+ * boot_dump() prints the marks with the time spent in each phase.
+ * Only the first BOOT_MARKS marks are kept.
+ */
+#define BOOT_MARKS	32
+static struct {
+	const char *what;
+	struct timespec t;
+} boot[BOOT_MARKS];
+static int nboot;
+
+void boot_mark(const char *what)
+{
+	if (nboot == BOOT_MARKS)
+		return;
+	boot[nboot].what = what;
+	clock_gettime(CLOCK_MONOTONIC, &boot[nboot++].t);
+}
+
+static double boot_ms(int i, int j)
+{
+	return (boot[i].t.tv_sec - boot[j].t.tv_sec) * 1e3 +
+		(boot[i].t.tv_nsec - boot[j].t.tv_nsec) / 1e6;
+}
+
+void boot_dump(FILE *f)
+{
+	int i;
+
+	fprintf(f, "     at ms   phase ms\n");
+	for (i = 0; i < nboot; i++)
+		fprintf(f, "%10.3f %10.3f %s\n", boot_ms(i, 0),
+			i ? boot_ms(i, i - 1) : 0.0, boot[i].what);
+	fflush(f);
+}
+
+/*
+ * Timers are in a binary heap ordered by due time, heap[1] is the
+ * first to expire. Each timer knows its slot so it can be removed.
+ */
+static struct timer **heap;
+static int nheap, maxheap;
+
+uint64_t timer_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void timer_now(struct timeval *now)
+{
+	uint64_t us = timer_us();
+
+	now->tv_sec = us / 1000000;
+	now->tv_usec = us % 1000000;
+}
+
+static void heap_put(int i, struct timer *t)
+{
+	heap[i] = t;
+	t->slot = i;
+}
+
+static void heap_up(int i)
+{
+	struct timer *t = heap[i];
+
+	for (; i > 1 && timercmp(&t->due, &heap[i/2]->due, <); i /= 2)
+		heap_put(i, heap[i/2]);
+	heap_put(i, t);
+}
+
+static void heap_down(int i)
+{
+	struct timer *t = heap[i];
+	int c;
+
+	for (; (c = 2*i) <= nheap; i = c) {
+		if (c < nheap && timercmp(&heap[c+1]->due, &heap[c]->due, <))
+			c++;
+		if (!timercmp(&heap[c]->due, &t->due, <))
+			break;
+		heap_put(i, heap[c]);
+	}
+	heap_put(i, t);
+}
+
+void timer_stop(struct timer *t)
+{
+	int i = t->slot;
+	struct timer *last;
+
+	t->fired = 0;
+	if (i == 0)
+		return;
+	t->slot = 0;
+	last = heap[nheap--];
+	if (last == t)
+		return;
+	heap_put(i, last);
+	heap_up(i);
+	heap_down(last->slot);
+}
+
+/* (re)start t to expire in ms, returns -1 if out of memory */
+int timer_start(struct timer *t, struct sess *s, int ms, int period)
+{
+	struct timeval now;
+
+	timer_stop(t);
+	if (nheap + 1 >= maxheap) {
+		int n = maxheap ? 2 * maxheap : 32;
+		struct timer **h = realloc(heap, n * sizeof(*h));
+
+		if (h == NULL)
+			return -1;
+		heap = h;
+		maxheap = n;
+	}
+	timer_now(&now);
+	timeradd_ms(&now, ms, &t->due);
+	t->period = period;
+	t->s = s;
+	heap_put(++nheap, t);
+	heap_up(nheap);
+	return 0;
+}
+
+int timer_fired(struct timer *t)
+{
+	int ret = t->fired;
+
+	t->fired = 0;
+	return ret;
+}
+
+/* mark the sessions with expired timers, and restart periodic ones */
+static void timers_run(const struct timeval *now)
+{
+	while (nheap && !timercmp(now, &heap[1]->due, <)) {
+		struct timer *t = heap[1];
+
+		t->s->flags |= SF_READY;
+		if (t->period <= 0) {
+			timer_stop(t);
+			t->fired = 1;
+			continue;
+		}
+		t->fired = 1;
+		/* missed periods are skipped, not run in a burst */
+		do {
+			timeradd_ms(&t->due, t->period, &t->due);
+		} while (!timercmp(now, &t->due, <));
+		heap_down(1);
+	}
+}
+
+/*
+ * The descriptors registered with sess_watch(), indexed by fd.
+ * With epoll the kernel keeps the interest set, otherwise
+ * (epfd < 0) the descriptors are added to the select() sets.
+ * Those epoll refuses (regular files, /dev/null) are polled: they
+ * are reported ready on every loop, which waits at most POLL_MS.
+ */
+struct watch {
+	struct sess *s;		/* owner, NULL if not watched */
+	uint8_t events;		/* SESS_READ, SESS_WRITE */
+	uint8_t revents;	/* ready in this loop */
+	uint8_t polled;		/* epoll refused it */
+};
+static struct watch *watch;
+static int nwatch;
+static int npolled;	/* watched fds with polled set */
+#define POLL_MS		100
+static int epfd = -1;
+static int *ready;	/* fds with revents set */
+static int nready, maxready;
+static int woken;	/* a session was woken, do not block */
+static int rewake;	/* lowest prio woken in the current pass */
+
+#define MAX_EPOLL	64	/* events per epoll_wait() */
+
+static void epoll_setup(void)
+{
+	epfd = epoll_create(MAX_EPOLL);	/* epoll_create1 is too recent */
+	if (epfd < 0) {
+		DBG(0, "no epoll, using select\n");
+		return;
+	}
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);	/* not for the shells */
+}
+
+int sess_watch(struct sess *s, int fd, int events)
+{
+	struct watch *w;
+	struct epoll_event ev;
+	int op, ret = 0;
+
+	if (fd < 0)
+		return -1;
+	if (fd >= nwatch) {
+		int n = fd + 32;
+
+		if (events == 0)
+			return 0;
+		w = realloc(watch, n * sizeof(*w));
+		if (w == NULL)
+			return -1;
+		memset(w + nwatch, 0, (n - nwatch) * sizeof(*w));
+		watch = w;
+		nwatch = n;
+	}
+	w = watch + fd;
+	if (w->s == (events ? s : NULL) && w->events == events)
+		return 0;	/* unchanged, the common case */
+	if (epfd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = (events & SESS_READ ? EPOLLIN : 0) |
+			(events & SESS_WRITE ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+		op = events == 0 ? EPOLL_CTL_DEL :
+			w->s ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		/* the fd may have been closed and reused in between */
+		if (epoll_ctl(epfd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+			op = errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+			if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+				/* e.g. regular files, remembered so we
+				 * do not retry on every call.
+				 */
+				DBG(0, "epoll_ctl %d failed %d, polled\n",
+					fd, errno);
+				ret = -1;
+			}
+		}
+		if (w->polled != (ret < 0)) {
+			w->polled = ret < 0;
+			npolled += w->polled ? 1 : -1;
+		}
+	}
+	w->s = events ? s : NULL;
+	w->events = events;
+	w->revents &= events;
+	return ret;
+}
+
+int sess_ready(int fd)
+{
+	return (fd >= 0 && fd < nwatch) ? watch[fd].revents : 0;
+}
+
+void sess_wake(struct sess *s)
+{
+	s->flags |= SF_READY;
+	woken = 1;
+	if (rewake > s->prio)
+		rewake = s->prio;
+}
+
+/* record events on a watched fd, and flag its session */
+static void set_ready(int fd, int events)
+{
+	struct watch *w = watch + fd;
+
+	if (fd >= nwatch || w->s == NULL || (events &= w->events) == 0)
+		return;
+	if (w->revents == 0) {
+		if (nready == maxready) {
+			int n = maxready ? 2 * maxready : MAX_EPOLL;
+			int *p = realloc(ready, n * sizeof(*p));
+			if (p == NULL)
+				return;
+			ready = p;
+			maxready = n;
+		}
+		ready[nready++] = fd;
+	}
+	w->revents |= events;
+	w->s->flags |= SF_READY;
+}
+
+/* collect the events from epoll, waiting at most ms */
+static int epoll_collect(int ms)
+{
+	struct epoll_event ev[MAX_EPOLL];
+	int i, n = epoll_wait(epfd, ev, MAX_EPOLL, ms);
+
+	for (i = 0; i < n; i++) {
+		int e = ev[i].events;
+		/* errors and hangups are reported as readable */
+		set_ready(ev[i].data.fd,
+		    (e & (EPOLLIN | EPOLLERR | EPOLLHUP) ? SESS_READ : 0) |
+		    (e & (EPOLLOUT | EPOLLERR) ? SESS_WRITE : 0));
+	}
+	return n;
+}
+
+/*
+ * Signals are blocked and read from a signalfd, or without one
+ * written by a handler to a pipe. Both are watched by the loop,
+ * which handles them before running the sessions.
+ * SIGCHLD is always on, to reap the children.
+ */
+static sigset_t sigmask, origmask;	/* delivered by us, at startup */
+static struct sess *sig_owner[NSIG];
+static volatile sig_atomic_t sig_got[NSIG];
+static int sigfd = -1;		/* signalfd, or read side of the pipe */
+static int sigpipe = -1;	/* write side of the pipe */
+static struct sess sig_sess;	/* owner of sigfd in watch[] */
+
+static void sig_handler(int sig)
+{
+	unsigned char c = sig;
+	int e = errno;
+
+	if (write(sigpipe, &c, 1) < 0)
+		sig_got[sig] = 1;	/* pipe full, still recorded */
+	errno = e;
+}
+
+static void sig_setup(void)
+{
+	int p[2];
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigmask, &origmask);
+	sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0 && pipe(p) == 0) {
+		DBG(0, "no signalfd, using a pipe\n");
+		sigfd = p[0];
+		sigpipe = p[1];
+		fcntl(sigfd, F_SETFL, O_NONBLOCK);
+		fcntl(sigpipe, F_SETFL, O_NONBLOCK);
+		fcntl(sigfd, F_SETFD, FD_CLOEXEC);
+		fcntl(sigpipe, F_SETFD, FD_CLOEXEC);
+		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+		signal(SIGCHLD, sig_handler);
+	}
+	sess_watch(&sig_sess, sigfd, SESS_READ);
+}
+
+int sess_signal(struct sess *s, int sig)
+{
+	if (sig <= 0 || sig >= NSIG || sig == SIGCHLD || sigfd < 0)
+		return -1;
+	sig_owner[sig] = s;
+	sig_got[sig] = 0;
+	if (sigpipe >= 0) {
+		signal(sig, s ? sig_handler : SIG_DFL);
+		return 0;
+	}
+	if (s) {
+		sigaddset(&sigmask, sig);
+		sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	} else {
+		sigset_t one;
+
+		sigdelset(&sigmask, sig);
+		sigemptyset(&one);
+		sigaddset(&one, sig);
+		sigprocmask(SIG_UNBLOCK, &one, NULL);
+	}
+	return signalfd(sigfd, &sigmask, 0) < 0 ? -1 : 0;
+}
+
+int sig_fired(int sig)
+{
+	int ret = sig_got[sig];
+
+	sig_got[sig] = 0;
+	return ret;
+}
+
+void sess_child(struct sess *s, pid_t pid)
+{
+	s->pid = pid;
+	s->flags &= ~SF_EXITED;
+}
+
+void sig_reset(void)
+{
+	int i;
+
+	for (i = 1; i < NSIG; i++) {
+		if (sig_owner[i] || i == SIGCHLD)
+			signal(i, SIG_DFL);
+	}
+	sigprocmask(SIG_SETMASK, &origmask, NULL);
+}
+
+static struct sess *find_child(struct sess *s, pid_t pid)
+{
+	for (; s; s = s->next) {
+		if (s->pid == pid)
+			break;
+	}
+	return s;
+}
+
+/* reap the children, and run the sessions that own them */
+static void reap(struct my_args *me)
+{
+	struct sess *s;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		s = find_child(me->sess, pid);
+		if (s == NULL)
+			s = find_child(me->tmp_sess, pid);
+		DBG(1, "child %d status 0x%x session %p\n", pid, status, s);
+		TRACE(0, TR_EXIT, pid, status, 0);
+		if (s == NULL)
+			continue;
+		s->status = status;
+		s->flags |= SF_EXITED;
+		sess_wake(s);	/* may still be in tmp_sess */
+	}
+}
+
+/* read the pending signals and wake up their sessions */
+static void sig_read(struct my_args *me)
+{
+	struct signalfd_siginfo si[8];
+	unsigned char c[16];
+	int i, n, child = 0;
+
+	if (sigpipe < 0) {
+		while ((n = read(sigfd, si, sizeof(si))) > 0) {
+			for (i = 0; i < n / sizeof(si[0]); i++) {
+				sig_got[si[i].ssi_signo] = 1;
+				TRACE(0, TR_SIGNAL, si[i].ssi_signo, 0, 0);
+			}
+		}
+	} else {
+		while ((n = read(sigfd, c, sizeof(c))) > 0) {
+			for (i = 0; i < n; i++) {
+				sig_got[c[i]] = 1;
+				TRACE(0, TR_SIGNAL, c[i], 0, 0);
+			}
+		}
+	}
+	for (i = 1; i < NSIG; i++) {
+		if (!sig_got[i])
+			continue;
+		if (i == SIGCHLD) {
+			sig_got[i] = 0;
+			child = 1;
+		} else if (sig_owner[i])
+			sess_wake(sig_owner[i]);
+	}
+	if (child)
+		reap(me);
+}
+
 /*
  * Generic session creation routine.
  * size is the size of the descriptor, fd is the main file descriptor
  * on which to work (ignored if -2, causes an error if -1),
  * cb is the callback function and arg a session-specific argument.
+ * The session starts as SF_POLL, and a valid fd is watched for reading.
  * NB: the new session is stored in a temporary list, otherwise
  * it might interfere with the scanning of the main list.
  * Lists are merged at the beginning of each mainloop.
@@ -96,32 +565,44 @@ void *new_sess(int size, int fd, cb_fn cb, void *arg)
     s->cb = cb;
     s->arg = arg;
     s->fd = fd;
+    s->flags = SF_POLL;
+    s->prio = SP_FG;
+    if (fd >= 0)
+	sess_watch(s, fd, SESS_READ);
     s->next = __me.tmp_sess;
     __me.tmp_sess = s;
     return s;
 }
 
 /*
- * Main loop implementing connection handling
+ * Main loop implementing connection handling.
+ * SF_POLL sessions set their descriptors in the prepare pass, and if
+ * they do, the loop waits in select() with the epoll fd among the
+ * others. Otherwise it waits in epoll_wait().
+ * Without timers or SF_POLL timeouts the loop sleeps until an event.
  */
 int mainloop(struct my_args *me)
 {
+    struct timeval now;
 
+    timer_now(&now);
     for (;;) {
-	int n;
+	int n, i, ms, fd, served;
+	uint64_t t0, t1;
+	cb_fn cb;
 	struct sess *s, *nexts, **ps;
 	fd_set r, w;
+	struct timeval *tv = NULL;	/* select() timeout */
 	struct cb_args a = {
-		.maxfd = 0,
+		.maxfd = -1,
 		.r = &r, .w = &w,
 		.run = 0 /* prepare select */
 	};
 
 	FD_ZERO(&r);
 	FD_ZERO(&w);
-	gettimeofday(&a.now, NULL);
-	a.due = a.now;
-	a.due.tv_sec += 1000;
+	a.now = now;
+	a.due.tv_sec = 0x7fffffff;	/* never */
 	/* prepare for select */
 	if (me->tmp_sess) {
 	    for (n = 1, s = me->tmp_sess; s->next; s = s->next)
@@ -133,46 +614,132 @@ int mainloop(struct my_args *me)
 	}
 	for (n = 0, s = me->sess; s; s = s->next) {
 	    n++;
+	    if (!(s->flags & SF_POLL))
+		continue;
 	    me->cur = s;
 	    me->app = s->app;
 	    if (s->cb(s, &a) && a.maxfd < s->fd)
 		a.maxfd = s->fd;
 	}
-	gettimeofday(&a.now, NULL);
-	a.due.tv_sec -= a.now.tv_sec;
-	a.due.tv_usec -= a.now.tv_usec;
-	if (a.due.tv_usec < 0) {
+	if (epfd < 0) {	/* select fallback, add the watched fds */
+	    for (i = 0; i < nwatch && i < FD_SETSIZE; i++) {
+		if (watch[i].events & SESS_READ)
+		    FD_SET(i, &r);
+		if (watch[i].events & SESS_WRITE)
+		    FD_SET(i, &w);
+		if (watch[i].events && a.maxfd < i)
+		    a.maxfd = i;
+	    }
+	} else if (a.maxfd >= 0) {
+	    FD_SET(epfd, &r);
+	    if (a.maxfd < epfd)
+		a.maxfd = epfd;
+	}
+	if (nheap)
+	    timersetmin(&a.due, &heap[1]->due);
+	if (npolled) {	/* look at the polled fds again in a while */
+	    struct timeval t;
+
+	    timeradd_ms(&now, POLL_MS, &t);
+	    timersetmin(&a.due, &t);
+	}
+	ms = -1;	/* forever */
+	if (woken) {
+	    timerclear(&a.due);
+	    tv = &a.due;
+	    ms = 0;
+	} else if (a.due.tv_sec != 0x7fffffff) {
+	    a.due.tv_sec -= now.tv_sec;
+	    a.due.tv_usec -= now.tv_usec;
+	    if (a.due.tv_usec < 0) {
 		a.due.tv_usec += 1000000;
 		a.due.tv_sec--;
-	}
-	if (a.due.tv_sec > 100)
-		a.due.tv_sec = 100;
-	if (a.due.tv_sec < 0)
+	    }
+	    if (a.due.tv_sec < 0)
 		a.due.tv_sec = a.due.tv_usec = 0;
-	DBG(2, "%d sessions due in %d.%06d\n", n, (int)a.due.tv_sec,  (int)a.due.tv_usec);
-	n = select(a.maxfd + 1, &r, &w, NULL, &a.due);
-	gettimeofday(&a.now, NULL);
-	if (n <= 0) {
-	    FD_ZERO(&r);
-	    FD_ZERO(&w);
-	    DBG(2, "select returns %d\n", n);
-	    /* still call handlers on timeouts and signals */
-	}
-	for (n = 0; wait3(NULL, WNOHANG, NULL) >0; n++) ;
-	if (n)
-		DBG(1, "%d children terminated\n", n);
+	    if (a.due.tv_sec > 1000000)	/* keep ms in range */
+		a.due.tv_sec = 1000000;
+	    tv = &a.due;
+	    ms = a.due.tv_sec * 1000 + (a.due.tv_usec + 999) / 1000;
+	}
+	DBG(2, "%d sessions due in %d ms\n", n, ms);
+	stats.loops++;
+	t0 = timer_us();
+	if (a.maxfd < 0 && epfd >= 0) {	/* only epoll */
+	    n = epoll_collect(ms);
+	    DBG(2, "epoll returns %d\n", n);
+	} else {
+	    n = select(a.maxfd + 1, &r, &w, NULL, tv);
+	    if (n <= 0) {
+		FD_ZERO(&r);
+		FD_ZERO(&w);
+		DBG(2, "select returns %d\n", n);
+		/* still call handlers on timeouts and signals */
+	    }
+	    if (epfd >= 0 && FD_ISSET(epfd, &r))
+		epoll_collect(0);
+	    for (i = 0; epfd < 0 && i < nwatch && i < FD_SETSIZE; i++)
+		set_ready(i, (FD_ISSET(i, &r) ? SESS_READ : 0) |
+			(FD_ISSET(i, &w) ? SESS_WRITE : 0));
+	}
+	for (i = 0; npolled && i < nwatch; i++) {	/* always ready */
+	    if (watch[i].polled)
+		set_ready(i, watch[i].events);
+	}
+	t1 = timer_us();
+	stats.wait_us += t1 - t0;
+	TRACE(2, TR_WAKE, n, t1 - t0, 0);
+	timer_now(&now);
+	a.now = now;
+	timers_run(&now);
+	if (sess_ready(sigfd))
+	    sig_read(me);
+	else if (sigfd < 0)	/* no way to get SIGCHLD */
+	    reap(me);
 	a.run = 1; /* now execute the handlers */
-	for (ps = &me->sess; (s = *ps) ;) {
+	woken = 0;
+	/*
+	 * One pass per priority, so input is not queued behind parsing.
+	 * A session woken by a later pass, e.g. the launchpad by the
+	 * output of the shown terminal, is run again once, with only
+	 * the woken sessions of the passes already done (up to served).
+	 */
+	served = -1;
+	rewake = SP_LEVELS;
+	for (i = 0; i < SP_LEVELS; i++) {
+	  for (ps = &me->sess; (s = *ps) ;) {
+	    nexts = s->next;
+	    if (s->prio != i || !(s->flags &
+		    (i <= served ? SF_READY : SF_POLL | SF_READY))) {
+		ps = &s->next;
+		continue;
+	    }
 	    DBG(2, "handle session %p\n", s);
+	    s->flags &= ~SF_READY;
 	    me->cur = s;
 	    me->app = s->app;
-	    nexts = s->next;
-	    if (s->cb(s, &a))	/* socket dead, unlink */
+	    cb = s->cb;	/* s is gone if it dies */
+	    fd = s->fd;
+	    n = cb(s, &a);
+	    t0 = timer_us();
+	    stats_cb(cb, t0 - t1);
+	    TRACE(2, TR_CB, fd, i, t0 - t1);
+	    t1 = t0;
+	    if (n)	/* socket dead, unlink */
 		*ps = nexts;
 	    else
 		ps = &s->next;
-		
+	  }
+	  if (rewake < i && served < 0) {
+	    served = i;
+	    i = rewake - 1;
+	  }
+	  rewake = SP_LEVELS;
 	}
+	for (i = 0; i < nready; i++)
+	    watch[ready[i]].revents = 0;
+	nready = 0;
+	timer_now(&now);	/* the handlers may take a while */
     }
     return 0;
 }
@@ -181,7 +748,10 @@ int main(int argc, char *argv[])
 {
     struct app **app, *a;
 
+    boot_mark("main");
     memset(&__me, 0, sizeof(__me));
+    epoll_setup();	/* before the apps watch their fds */
+    sig_setup();
     __me.all_apps = all_apps;
     /* main program arguments */
 #ifndef NODEBUG
@@ -210,6 +780,7 @@ int main(int argc, char *argv[])
 	if ( a->start)
 	    a->start();
     }
+    boot_mark("apps started");
     mainloop(&__me);
     return 0;
 }
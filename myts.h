@@ -43,6 +43,7 @@ destructor, and private data.
 #include <memory.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/time.h>	/* gettimeofday */
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -76,6 +77,12 @@ struct app {
  * callback in 'prepare' mode returns 1 if fd active.
  * callback in 'run' mode returns 0 if ok, 1 if dying.
  *	destruction must be done in the callback itself
+ * Only SF_POLL sessions (the default) are called in 'prepare' mode,
+ * and in 'run' mode on every loop. Other sessions register their fds
+ * with sess_watch() and use timers, and are only run when one of
+ * them is ready or expired.
+ * In 'run' mode sessions are served by prio, SP_INPUT first.
+ * All times, including now and due, are on CLOCK_MONOTONIC.
  */
 struct cb_args {
 	struct timeval now;
@@ -93,7 +100,18 @@ struct sess {
 	cb_fn	cb;
 	void *arg;	/* identifier */
 	int fd;
+	int flags;	/* SF_* below */
+	pid_t pid;	/* child owned by the session, see sess_child() */
+	int status;	/* its wait() status, once SF_EXITED */
+	int prio;	/* SP_* below */
 };
+#define SF_POLL		1	/* old style, prepare pass and fd_sets */
+#define SF_READY	2	/* has ready fds or has been woken up */
+#define SF_EXITED	4	/* the child has been reaped */
+#define SP_INPUT	0	/* input devices */
+#define SP_FG		1	/* the visible session, the default */
+#define SP_BG		2	/* hidden sessions */
+#define SP_LEVELS	3
 
 /*
  * All sessions should start with a 'struct sess'
@@ -119,6 +137,50 @@ extern struct my_args __me;
  */
 void *new_sess(int size, int fd, cb_fn cb, void *arg);
 
+/* events for sess_watch() and sess_ready() */
+#define SESS_READ	1
+#define SESS_WRITE	2
+
+/* set the events to watch on fd for session s, 0 to stop */
+int sess_watch(struct sess *s, int fd, int events);
+/* the events ready on fd in the current loop */
+int sess_ready(int fd);
+/* run the callback of s in the next loop */
+void sess_wake(struct sess *s);
+
+/*
+ * Signals are delivered by the main loop: sess_signal() runs s when
+ * sig arrives (s == NULL restores the default), and sig_fired() then
+ * returns true once. Children are reaped by the loop, and the session
+ * registered with sess_child() is run with SF_EXITED set.
+ * sig_reset() must be called in a child before exec.
+ */
+int sess_signal(struct sess *s, int sig);
+int sig_fired(int sig);
+void sess_child(struct sess *s, pid_t pid);
+void sig_reset(void);
+
+/*
+ * Timers, kept in a heap by the main loop. When a timer expires its
+ * session is run, and timer_fired() returns true once. A zeroed
+ * timer is stopped. period (ms) > 0 makes it periodic.
+ */
+struct timer {
+	struct timeval due;
+	int period;
+	int slot;		/* position in the heap, 0 if stopped */
+	int fired;
+	struct sess *s;
+};
+int timer_start(struct timer *t, struct sess *s, int ms, int period);
+void timer_stop(struct timer *t);
+int timer_fired(struct timer *t);
+#define timer_armed(t)	((t)->slot != 0)
+/* the current time on CLOCK_MONOTONIC */
+void timer_now(struct timeval *now);
+/* the same in microseconds */
+uint64_t timer_us(void);
+
 /* add a millisecond value to a timer */
 void timeradd_ms(const struct timeval *src, int ms, struct timeval *dst);
 /* set dst to the min of the two */
@@ -126,6 +188,10 @@ void timersetmin(struct timeval *dst, const struct timeval *cur);
 /* returns true if dst is set and <= 'now' */
 int timerdue(const struct timeval *dst, const struct timeval *now);
 
+/* record the end of a startup phase, and print the timeline */
+void boot_mark(const char *what);
+void boot_dump(FILE *f);
+
 extern int bytesperchar;
 
 #endif /* _MYTS_H_ */
@@ -17,14 +17,92 @@
 #include "myts.h"
 #include "pixop.h"
 
+#define BE2LE(x) (x << 24 | x >> 24 | (x & (uint32_t)0x0000ff00UL) << 8 | (x & (uint32_t)0x00ff0000UL) >> 8)
+
+/* 8 pixels at 1bpp to 4 bytes at 4bpp, built by pix_init() */
+static uint32_t quadbits[256];
+
+void pix_init(void)
+{
+    unsigned int j;
+    int i,k;
+    for (i=0;i<256;i++) {
+        j=0;
+        for(k=0;k<8;k++) {
+            j<<=4;
+            if(i&(128>>k))j+=15;
+        }
+        quadbits[i]=BE2LE(j);
+    }
+}
+
+/* copy one row of width pixels at 4bpp, dst is odd if the
+ * destination starts in the low nibble.
+ */
+static inline void blt_row(unsigned char *dstp, const unsigned char *srcp,
+	int odd, int width, int bg)
+{
+    int j, w;
+
+    if(!odd) {
+        w=width/2;
+        if (bg) {
+            for (j=0; j< w; j++)
+                dstp[j] = srcp[j] | bg;
+        } else
+            memcpy(dstp, srcp, w);
+        if(width&1) 
+            dstp[w]=(dstp[w]&0x0f) | (srcp[w]&0xf0) | (bg&0xf0);
+    } else {
+        w=(width+1)/2;
+        dstp[0]=(dstp[0]&0xf0) | (srcp[0]>>4) | (bg&0x0f);
+        for(j=1;j<w;j++) dstp[j]=(srcp[j-1]<<4) | (srcp[j]>>4) | bg;
+        if(!(width&1))
+            dstp[w]=(dstp[w]&0x0f) | (srcp[w-1]<<4) | (bg&0xf0);
+    }
+}
+
+/* byte k of a 1bpp row expanded to 4bpp */
+static inline unsigned char x1(const unsigned char *srcp, int k)
+{
+    return ((const unsigned char *)(quadbits + srcp[k >> 2]))[k & 3];
+}
+
+/* as blt_row(), expanding a 1bpp src row while storing it */
+static inline void blt_row1(unsigned char *dstp, const unsigned char *srcp,
+	int odd, int width, int bg)
+{
+    uint32_t v, bg4 = (unsigned char)bg * 0x01010101u;
+    int j, w;
+
+    if(!odd) {
+        w=width/2;
+        for (j=0; j+4 <= w; j+=4) {	/* 8 pixels at a time */
+            v = quadbits[srcp[j >> 2]] | bg4;
+            memcpy(dstp+j, &v, 4);
+        }
+        for (; j < w; j++)
+            dstp[j] = x1(srcp, j) | bg;
+        if(width&1) 
+            dstp[w]=(dstp[w]&0x0f) | (x1(srcp, w)&0xf0) | (bg&0xf0);
+    } else {
+        w=(width+1)/2;
+        dstp[0]=(dstp[0]&0xf0) | (x1(srcp, 0)>>4) | (bg&0x0f);
+        for(j=1;j<w;j++) dstp[j]=(x1(srcp, j-1)<<4) | (x1(srcp, j)>>4) | bg;
+        if(!(width&1))
+            dstp[w]=(dstp[w]&0x0f) | (x1(srcp, w-1)<<4) | (bg&0xf0);
+    }
+}
+
 /* transfer pixmap "src:sx,sy (width:height)" to pixmap "dst: dx, dy"
  * bg, if non-zero, is OR-ed to every byte in the dst region.
- * This function assumes bpp=4, sx%2=0.
+ * This function assumes dst bpp=4, sx%2=0. A 1bpp src (a glyph,
+ * at most PIX1_MAXW wide, sx=0) is expanded while copying.
  */
 int pix_blt(pixmap_t* dst, int dx, int dy,
 	pixmap_t* src, int sx, int sy, int width, int height, int bg)
 {
-    int w, i, j;
+    int i;
 	unsigned char *dstp, *srcp;
 	int dst_stride, src_stride;
 
@@ -41,37 +119,54 @@ int pix_blt(pixmap_t* dst, int dx, int dy,
 //	c_truncate(&dy, &height, dst->height);
 
 	dst_stride = (dst->width + 1)/2;
-	src_stride = (src->width + 1)/2;
 	dstp = dst->surface + dy*dst_stride + dx/2;
+	if (src->bpp == 1) {
+		if (width > PIX1_MAXW)
+			width = PIX1_MAXW;
+		src_stride = (src->width + 7)/8;
+		srcp = src->surface + sy*src_stride;
+		for (i = 0; i < height; i++) {
+			blt_row1(dstp, srcp, dx & 1, width, bg);
+			dstp += dst_stride;
+			srcp += src_stride;
+		}
+		return width*height;
+	}
+	src_stride = (src->width + 1)/2;
 	srcp = src->surface + sy*src_stride + sx/2;
-    if(!(dx&1)) {
-        w=width/2;
-        for (i=0; i< height; i++) {
-            memcpy(dstp, srcp, w);
-            if (bg) {
-                for (j=0; j< w; j++)
-                    dstp[j] |= bg;
-            }
-            if(width&1) 
-                dstp[w]=(dstp[w]&0x0f) | (srcp[w]&0xf0) | (bg&0xf0);
-            dstp += dst_stride;
-            srcp += src_stride;
-        }
-    } else {
-        int j;
-        w=(width+1)/2;
-        for(i=0; i< height; i++) {
-            dstp[0]=(dstp[0]&0xf0) | (srcp[0]>>4) | (bg&0x0f);
-            for(j=1;j<w;j++) dstp[j]=(srcp[j-1]<<4) | (srcp[j]>>4) | bg;
-            if(!(width&1))
-                dstp[w]=(dstp[w]&0x0f) | (srcp[w-1]<<4) | (bg&0xf0);
-            dstp += dst_stride;
-            srcp += src_stride;
-        }
-    }
+	for (i=0; i< height; i++) {
+		blt_row(dstp, srcp, dx & 1, width, bg);
+		dstp += dst_stride;
+		srcp += src_stride;
+	}
     return width*height;
 }
 
+/* fill a rectangle of dst with the color in bg, which must have
+ * both nibbles set. This function assumes bpp=4.
+ */
+void pix_fill(pixmap_t *dst, int x, int y, int width, int height, int bg)
+{
+	int i, stride = (dst->width + 1)/2;
+	unsigned char *p = dst->surface + y*stride + x/2;
+
+	for (i = 0; i < height; i++, p += stride) {
+		unsigned char *q = p;
+		int w = width;
+
+		if (w <= 0)
+			break;
+		if (x & 1) {
+			*q = (*q & 0xf0) | (bg & 0x0f);
+			q++;
+			w--;
+		}
+		memset(q, bg, w/2);
+		if (w & 1)
+			q[w/2] = (q[w/2] & 0x0f) | (bg & 0xf0);
+	}
+}
+
 pixmap_t * pix_alloc(int w, int h)
 {
 	int size = ((w+1)/2)*h + sizeof(pixmap_t) ;
@@ -45,9 +45,15 @@ int get_char_pixmap(const struct font *f, int code, pixmap_t *ppx) ;
 const struct font * getfngfont(const char *path) ;
 void freefngfont(const struct font *) ;
 
+#define PIX1_MAXW	16	/* widest 1bpp pixmap pix_blt can expand */
+
+void pix_init(void) ;
+
 int pix_blt(pixmap_t* dst, int dx, int dy,
 	pixmap_t* src, int sx, int sy, int width, int height, int bg) ;
 
+void pix_fill(pixmap_t *dst, int x, int y, int width, int height, int bg) ;
+
 pixmap_t * pix_alloc(int w, int h) ;
 void pix_free(pixmap_t *p) ;
 
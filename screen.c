@@ -18,6 +18,8 @@
 #include "myts.h"
 #include "pixop.h"
 #include "screen.h"
+#include "stats.h"
+#include "trace.h"
 
 extern int bytesperchar;
 typedef unsigned char u8 ;
@@ -94,6 +96,7 @@ void fb_update_area(fbscreen_t *fb,
 {
 	update_area_t ua;
 	int ret;
+	uint64_t t;
 
 	c_truncate(&x0, &w, fb->pixmap.width);
 	c_truncate(&y0, &h, fb->pixmap.height);
@@ -106,7 +109,13 @@ void fb_update_area(fbscreen_t *fb,
 	if (w == 0 || h == 0)
 		return;
 
+	stats.updates++;
+	stats.pixels += w * h;
+	t = timer_us();
 	ret = ioctl(fb->fd, FBIO_EINK_UPDATE_DISPLAY_AREA, &ua);
+	t = timer_us() - t;
+	hist_add(&stats.update_us, t);
+	TRACE(1, TR_UPDATE, x0 << 16 | y0, w << 16 | h, t);
 	if (ret) {
 		DBG(1, "%s @%d %d %d x %d error %d\n",
 			__FUNCTION__, x0, y0, w, h, errno);
@@ -147,13 +156,9 @@ int get_char_pixmap(const struct font *font, int code, pixmap_t *ppx)
         ppx->width = font_pixmap.width ;
         ppx->height = font_pixmap.height ;
         ppx->bpp = font_pixmap.bpp ;
-        if(bytesperchar==2) {
-            uint32_t *b=(uint32_t*)font->pixmap;
-            ppx->surface=(unsigned char *)b[code];
-            if (!ppx->surface) ppx->surface=(unsigned char *)b[0xfffd];
-            if (!ppx->surface) ppx->surface=(unsigned char *)b[0xbf];
-            if (!ppx->surface) ppx->surface=(unsigned char *)b[0x20];
-        } else 
+        if(bytesperchar==2)
+            ppx->surface=font_glyph(code);
+        else 
             ppx->surface = (font->pixmap + (code-font->code_first)*byteschar) ;
         return code ;
 }
@@ -0,0 +1,103 @@
+/*
+ * Runtime counters and histograms, see stats.h
+ *
+ * They are always on and cost an increment, or a clock read per
+ * callback in the main loop, so they can be looked at on the device
+ * without a debug build: SIGUSR1 prints them on stderr, the S command
+ * of the control socket returns them.
+ */
+
+#include "myts.h"
+#include "stats.h"
+
+#define STATS_CBS	16	/* distinct callbacks, the rest is lost */
+
+struct stats stats;
+
+static struct {
+	void *fn;
+	const char *name;
+	uint64_t calls, us;
+	uint32_t max;
+} cbs[STATS_CBS];
+static int ncbs;
+
+void hist_add(struct hist *h, uint32_t v)
+{
+	int i = v ? 32 - __builtin_clz(v) : 0;
+
+	h->n[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+	h->sum += v;
+	if (h->max < v)
+		h->max = v;
+}
+
+static void hist_dump(dynstr *out, const char *name, const struct hist *h)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		n += h->n[i];
+	dsprintf(out, "%s n %llu avg %llu max %u\n", name,
+		(unsigned long long)n,
+		(unsigned long long)(n ? h->sum / n : 0), h->max);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (h->n[i])
+			dsprintf(out, "  < %8u %10u\n", 1u << i, h->n[i]);
+	}
+}
+
+static int cb_slot(void *fn)
+{
+	int i;
+
+	for (i = 0; i < ncbs; i++) {
+		if (cbs[i].fn == fn)
+			return i;
+	}
+	if (ncbs == STATS_CBS)
+		return -1;
+	cbs[ncbs].fn = fn;
+	return ncbs++;
+}
+
+void stats_cb(void *fn, uint32_t us)
+{
+	int i = cb_slot(fn);
+
+	if (i < 0)
+		return;
+	cbs[i].calls++;
+	cbs[i].us += us;
+	if (cbs[i].max < us)
+		cbs[i].max = us;
+}
+
+void stats_name(void *fn, const char *name)
+{
+	int i = cb_slot(fn);
+
+	if (i >= 0)
+		cbs[i].name = name;
+}
+
+void stats_dump(dynstr *out)
+{
+	int i;
+
+	dsprintf(out, "loops %llu wait_ms %llu\n",
+		(unsigned long long)stats.loops,
+		(unsigned long long)stats.wait_us / 1000);
+	dsprintf(out, "glyphs %llu updates %llu pixels %llu\n",
+		(unsigned long long)stats.glyphs,
+		(unsigned long long)stats.updates,
+		(unsigned long long)stats.pixels);
+	for (i = 0; i < ncbs; i++) {
+		dsprintf(out, "cb %s calls %llu ms %llu max_us %u\n",
+			cbs[i].name ? cbs[i].name : "?",
+			(unsigned long long)cbs[i].calls,
+			(unsigned long long)cbs[i].us / 1000, cbs[i].max);
+	}
+	hist_dump(out, "update_us", &stats.update_us);
+}
@@ -0,0 +1,41 @@
+/*
+ * Runtime counters and histograms, see stats.c
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include "dynstring.h"
+
+/* log2 histogram, bucket i counts values below 2^i */
+#define HIST_BUCKETS	24
+struct hist {
+	uint32_t n[HIST_BUCKETS];
+	uint64_t sum;
+	uint32_t max;
+};
+void hist_add(struct hist *h, uint32_t v);
+
+/*
+ * The global counters, only updated by the main thread. The terminals
+ * keep their own, see term_stats().
+ */
+struct stats {
+	uint64_t loops;		/* main loop iterations */
+	uint64_t wait_us;	/* spent waiting for events */
+	uint64_t glyphs;	/* chars drawn */
+	uint64_t updates;	/* screen update rectangles */
+	uint64_t pixels;	/* and their area */
+	struct hist update_us;	/* time in the update ioctl */
+};
+extern struct stats stats;
+
+/* account us to the session callback fn, named by stats_name() */
+void stats_cb(void *fn, uint32_t us);
+void stats_name(void *fn, const char *name);
+
+/* append all of the above to out, one item per line */
+void stats_dump(dynstr *out);
+
+#endif /* _STATS_H_ */
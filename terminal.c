@@ -34,8 +34,12 @@
 
 #include "myts.h"
 #include "terminal.h"
+#include "dynstring.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <signal.h>	/* kill */
+#include <sys/wait.h>	/* WEXITSTATUS */
 #include <termios.h>	/* struct winsize */
 #ifdef linux
 #include <pty.h>
@@ -44,9 +48,14 @@
 #endif
 #include <errno.h>
 #include <ctype.h>      /* isalnum */
+#include <poll.h>
+#include <pthread.h>
 
 #define KMAX	1024	/* keyboard queue */
 #define SMAX	1024	/* screen queue */
+#define PASTE_MAX	(1<<20)	/* injected text not yet sent */
+#define PMAX	32	/* predicted chars */
+#define PRED_TIMEOUT	2000	/* ms to confirm a prediction */
 
 #define BYTES bytesperchar
 
@@ -82,6 +91,30 @@ enum {
 	ka_bg = 0x38,	/* background mask */
 };
 
+/*
+ * With a parser thread the pty is read and parsed by the thread
+ * under lock, and the main thread is told through the note pipe.
+ * The main thread keeps the keys, the timers and a snapshot of the
+ * page for term_state(), refreshed from the dirty rows.
+ */
+struct worker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	int note[2];		/* thread to main loop */
+	int stop[2];		/* main loop to thread */
+	int notified, eof;
+	/* the snapshot */
+	int sb_pushed, dmg_lo, dmg_hi;
+	char *page, *attributes, *sb_page, *sb_attributes, *dirty;
+	uint16_t *blank;
+	uint8_t *blank_attr;
+};
+
+#define LOCK(sh)	do { if ((sh)->thr) \
+		pthread_mutex_lock(&(sh)->thr->lock); } while (0)
+#define UNLOCK(sh)	do { if ((sh)->thr) \
+		pthread_mutex_unlock(&(sh)->thr->lock); } while (0)
+
 /*
  * struct my_sess describes a shell session to which we talk.
  */
@@ -95,9 +128,23 @@ struct my_sess {
 	int kseq;       // need a sequence number for kb input ?
 	int klen;       /* pending input for keyboard */
 	char keys[KMAX];
+	dynstr paste;	/* from term_inject(), after the keys */
 	int kflags;     /* dec mode etc */
 	int slen;       /* pending input for screen */
 	char sbuf[SMAX];
+	int budget;	/* max bytes read per wakeup, 0 no limit */
+	int more;	/* the last read was full, read again */
+	struct sess *viewer;	/* woken after parsing, see term_viewer() */
+	char *lazy;	/* raw output while hidden, see term_lazy() */
+	int lazy_max, lazy_len;
+	int spilled;	/* the page went to the scrollback */
+	struct worker *thr;	/* parser thread, see term_thread() */
+	/* counters, see term_stats() */
+	uint64_t st_read;	/* bytes from the shell */
+	unsigned st_csi['~' - '@' + 1];	/* CSI sequences by final byte, '@' to '~' */
+	unsigned st_esc;	/* other escape sequences */
+	unsigned st_unknown;	/* sequences not handled */
+	unsigned st_scrolls, st_evicted;	/* scrollback rows lost */
 
 	/* store pagelen instead of recomputing it all the times */
 	int rows, cols, pagelen; /* geometry */
@@ -111,7 +158,11 @@ struct my_sess {
 	 */
 	int scroll_top, scroll_bottom;
 	/* the page is made of rows*cols chars followed by attributes
-	 * with the same layout
+	 * with the same layout.
+	 * blank[r] is the column from which row r is blank, with
+	 * attribute blank_attr[r] (cols if there is no blank tail).
+	 * Chars and attributes past blank[r] are stale and must not
+	 * be used, see materialize().
 	 */
 	/*
 	 * attributes -- we use bits for foreground and bg color.
@@ -119,29 +170,229 @@ struct my_sess {
 	uint8_t		cur_attr;	/* current attributes */
 
     int sb_lines;
+    int sb_pushed;	/* rows added to the scrollback, ever */
     char *sb_page;
     char *sb_attributes;
     unsigned short *page16;
     char *attributes;
 	char *page;     /* dump of the screen */
+	char *dirty;	/* one flag per row, set on changes, cleared by readers */
+	int dmg_lo, dmg_hi;	/* chars changed since the last read */
+	uint16_t *blank;	/* per row, start of the blank tail */
+	uint8_t *blank_attr;	/* per row, attribute of the blank tail */
+
+	/* local echo prediction, see predict() */
+	int predict;		/* 1 on, 0 off, -1 suspended until Enter */
+	int pred_cur;		/* position of the first predicted char */
+	int pred_len;
+	uint16_t pred[PMAX];
+	struct timer pred_timer;	/* rollback if still unconfirmed */
 };
 
+static void touch(struct my_sess *sh, int start, int len);
+
+/* the char at offset i of the page, blank tails included */
+static int page_char(struct my_sess *sh, int i)
+{
+	if (i % sh->cols >= sh->blank[i / sh->cols])
+		return ' ';
+	return UTF8 ? sh->page16[i] : (uint8_t)sh->page[i];
+}
+
+/* drop all predictions, the cells will be redrawn from the page */
+static void pred_rollback(struct my_sess *sh)
+{
+	if (sh->pred_len == 0)
+		return;
+	DBG(1, "rollback %d predictions at %d\n", sh->pred_len, sh->pred_cur);
+	touch(sh, sh->pred_cur, sh->pred_len + 1);
+	sh->pred_len = 0;
+	sh->modified = 1;
+	timer_stop(&sh->pred_timer);
+}
+
+/*
+ * Local echo prediction, in the spirit of mosh.
+ * Printable keys are shown at once at the cursor, and confirmed
+ * or rolled back by pred_check() when the shell output arrives.
+ * We do not predict in full screen applications (cursor key mode,
+ * scroll regions, hidden cursor) or in local password prompts
+ * (no echo in canonical mode). A prediction not confirmed within
+ * PRED_TIMEOUT, e.g. a remote password prompt, suspends predictions
+ * until the next Enter.
+ */
+static void predict(struct my_sess *sh, const char *k)
+{
+	struct termios t;
+	int p = sh->pred_cur + sh->pred_len;
+
+	if (!strcmp(k, "\r")) {
+		if (sh->predict < 0)
+			sh->predict = 1;
+		return;
+	}
+	if (sh->predict <= 0)
+		return;
+	if (k[0] == 0x7f && !k[1]) {	/* backspace, unpredict one */
+		if (sh->pred_len > 0) {
+			sh->pred_len--;
+			touch(sh, p - 1, 2);
+			sh->modified = 1;
+		}
+		return;
+	}
+	if (k[1] || k[0] < 0x20 || k[0] > 0x7e)
+		return;
+	if ((sh->kflags & (kf_priv | kf_nocursor)) || sh->originmode ||
+	    sh->scroll_top != 0 || sh->scroll_bottom != sh->rows)
+		return;
+	if (tcgetattr(sh->sess.fd, &t) == 0 &&
+	    (t.c_lflag & (ICANON | ECHO)) == ICANON)
+		return;
+	if (sh->pred_len == 0) {
+		p = sh->pred_cur = sh->cur;
+		timer_start(&sh->pred_timer, &sh->sess, PRED_TIMEOUT, 0);
+	}
+	/* stay on the cursor row, away from the wrap column */
+	if (sh->pred_len == PMAX || p % sh->cols >= sh->cols - 2 ||
+	    (sh->kflags & kf_wrapped))
+		return;
+	sh->pred[sh->pred_len++] = k[0];
+	touch(sh, p, 2);
+	sh->modified = 1;
+}
+
+/*
+ * After new shell output, predictions echoed by the shell are
+ * confirmed. If the cursor went anywhere else they were wrong.
+ */
+static void pred_check(struct my_sess *sh)
+{
+	while (sh->pred_len && sh->cur > sh->pred_cur &&
+	    page_char(sh, sh->pred_cur) == sh->pred[0]) {
+		sh->pred_cur++;
+		sh->pred_len--;
+		memmove(sh->pred, sh->pred + 1, sh->pred_len*sizeof(sh->pred[0]));
+		timer_start(&sh->pred_timer, &sh->sess, PRED_TIMEOUT, 0);
+	}
+	if (sh->pred_len && sh->cur != sh->pred_cur)
+		pred_rollback(sh);
+	else if (sh->pred_len == 0)
+		timer_stop(&sh->pred_timer);	/* all confirmed */
+}
+
+void term_predict(struct sess *sess, int on)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+
+	if (!sh)
+		return;
+	LOCK(sh);
+	pred_rollback(sh);
+	sh->predict = on ? 1 : 0;
+	UNLOCK(sh);
+}
+
+void term_budget(struct sess *sess, int bytes)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+
+	if (!sh)
+		return;
+	LOCK(sh);
+	sh->budget = bytes > 0 ? bytes : 0;
+	UNLOCK(sh);
+	sh->sess.prio = sh->budget ? SP_BG : SP_FG;
+	if (sh->more)	/* the rest is read at the new priority */
+		sess_wake(sess);
+}
+
+void term_viewer(struct sess *sess, struct sess *viewer)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+
+	if (sh)
+		sh->viewer = viewer;
+}
+
+/* the pty is read by the main loop unless there is a parser thread */
+#define PTY_EVENTS(sh)	(((sh)->thr ? 0 : SESS_READ) | \
+		((sh)->klen || ds_len((sh)->paste) ? SESS_WRITE : 0))
+
 int term_keyin(struct sess *sess, char *k)
 {
 	struct my_sess *sh = (struct my_sess *)sess;
 
+	LOCK(sh);
+	if (sh->predict)
+		predict(sh, k);
+
         /* map arrow keys to DEC in private mode. */
         if ((sh->kflags & kf_priv) && strlen(k) > 2 &&
 			k[0] == '\033' && k[1] == '[' && index("ABCD", k[2])) {
 		    k[1] = 'O';
         }
+	UNLOCK(sh);
 
         /* silently drop chars in case of overflow */
         strncat(sh->keys + sh->klen, k, sizeof(sh->keys) - 1 - sh->klen);
         sh->klen = strlen(sh->keys);
+	if (sh->klen)
+		sess_watch(sess, sess->fd, PTY_EVENTS(sh));
+	return 0;
+}
+
+int term_inject(struct sess *sess, const char *buf, int len)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+
+	if (!sh || sh->sess.fd < 0 || len < 0 ||
+	    ds_len(sh->paste) + len > PASTE_MAX)
+		return -1;
+	if (ds_append(&sh->paste, buf, len) < 0)
+		return -1;
+	sess_watch(sess, sess->fd, PTY_EVENTS(sh));
 	return 0;
 }
 
+/*
+ * Copy the rows changed by the parser thread to the snapshot, and
+ * move their dirty flags there. Called with the lock held.
+ */
+static void snap_take(struct my_sess *sh)
+{
+	struct worker *w = sh->thr;
+	int r, n = sh->cols;
+
+	for (r = 0; r < sh->rows; r++) {
+		if (!sh->dirty[r])
+			continue;
+		memcpy(w->page + r*n*BYTES, sh->page + r*n*BYTES, n*BYTES);
+		memcpy(w->attributes + r*n, sh->attributes + r*n, n);
+		w->blank[r] = sh->blank[r];
+		w->blank_attr[r] = sh->blank_attr[r];
+		w->dirty[r] = 1;
+		sh->dirty[r] = 0;
+	}
+	if (w->sb_pushed != sh->sb_pushed) {
+		memcpy(w->sb_page, sh->sb_page, sh->sb_lines*n*BYTES);
+		memcpy(w->sb_attributes, sh->sb_attributes, sh->sb_lines*n);
+		w->sb_pushed = sh->sb_pushed;
+	}
+	if (sh->dmg_hi > sh->dmg_lo) {
+		if (w->dmg_hi <= w->dmg_lo) {
+			w->dmg_lo = sh->dmg_lo;
+			w->dmg_hi = sh->dmg_hi;
+		} else {
+			if (sh->dmg_lo < w->dmg_lo)
+				w->dmg_lo = sh->dmg_lo;
+			if (sh->dmg_hi > w->dmg_hi)
+				w->dmg_hi = sh->dmg_hi;
+		}
+		sh->dmg_lo = sh->dmg_hi = 0;
+	}
+}
+
 
 /* return the 'modified' flag.
  * If ptr is set, clears the modified flag and returns
@@ -150,9 +401,11 @@ int term_keyin(struct sess *sess, char *k)
 int term_state(struct sess *sess, struct term_state *ptr)
 {
 	struct my_sess *sh = (struct my_sess *)sess;
+	struct worker *w;
 	int ret;
 	if (!sh)
 		return 0;
+	LOCK(sh);
 	ret = sh->modified;
 	DBG(2, "called on %s %s modified %d\n", sh->name,
 		ptr ? "reset" : "keep", ret);
@@ -172,53 +425,160 @@ int term_state(struct sess *sess, struct term_state *ptr)
 		ptr->rows = sh->rows;
 		ptr->cols = sh->cols;
 		ptr->cur = (sh->kflags & kf_nocursor) ? -1 : sh->cur;
+		if (sh->pred_len && ptr->cur >= 0)	/* after predictions */
+			ptr->cur = sh->pred_cur + sh->pred_len;
+		ptr->pred = sh->pred;
+		ptr->pred_cur = sh->pred_cur;
+		ptr->pred_len = sh->pred_len;
 		ptr->data = sh->page;
 		ptr->attr = sh->attributes;
 		ptr->sb_data = sh->sb_page;
 		ptr->sb_attr = sh->sb_attributes;
         ptr->top = sh->top;
+		ptr->dirty = sh->dirty;
+		ptr->blank = sh->blank;
+		ptr->blank_attr = sh->blank_attr;
+		if ((w = sh->thr)) {	/* the snapshot instead */
+			snap_take(sh);	/* moves the damage to w */
+			ptr->data = w->page;
+			ptr->attr = w->attributes;
+			ptr->sb_data = w->sb_page;
+			ptr->sb_attr = w->sb_attributes;
+			ptr->dirty = w->dirty;
+			ptr->blank = w->blank;
+			ptr->blank_attr = w->blank_attr;
+			ptr->dmg_lo = w->dmg_lo;
+			ptr->dmg_hi = w->dmg_hi;
+			if (ptr->flags & TS_MOD)
+				w->dmg_lo = w->dmg_hi = 0;
+		} else {
+			ptr->dmg_lo = sh->dmg_lo;
+			ptr->dmg_hi = sh->dmg_hi;
+			if (ptr->flags & TS_MOD)
+				sh->dmg_lo = sh->dmg_hi = 0;
+		}
 	}
+	UNLOCK(sh);
 	return ret;
 }
 
+/* mark the rows covering chars [start, start+len) as modified */
+static void touch(struct my_sess *sh, int start, int len)
+{
+	int first = start / sh->cols, last = (start + len - 1) / sh->cols;
+
+	if (len <= 0)
+		return;
+	if (sh->dmg_hi <= sh->dmg_lo) {
+		sh->dmg_lo = start;
+		sh->dmg_hi = start + len;
+	} else {
+		if (start < sh->dmg_lo)
+			sh->dmg_lo = start;
+		if (start + len > sh->dmg_hi)
+			sh->dmg_hi = start + len;
+	}
+	if (last >= sh->rows)
+		last = sh->rows - 1;
+	if (first <= last)
+		memset(sh->dirty + first, 1, last - first + 1);
+}
+
+/* write blanks with the given attribute in chars [c0, c1) of a row */
+static void fill_blank(struct my_sess *sh, int row, int c0, int c1, int attr)
+{
+	int i, start = row*sh->cols + c0;
+
+	if (c1 <= c0)
+		return;
+	if (UTF8) {
+		for (i = 0; i < c1 - c0; i++)
+			sh->page16[start + i] = 0x20;
+	} else
+		memset(sh->page + start, ' ', c1 - c0);
+	memset(sh->attributes + start, attr, c1 - c0);
+}
+
+/* make the chars of a row before 'col' real, shrinking the blank tail */
+static void materialize(struct my_sess *sh, int row, int col)
+{
+	if (sh->blank[row] >= col)
+		return;
+	fill_blank(sh, row, sh->blank[row], col, sh->blank_attr[row]);
+	sh->blank[row] = col;
+}
+
 /* erase part of the 'screen' from 'start' for 'len' chars.
  * also taking care of the attributes.
+ * Erasing to the end of a row only moves the blank marker,
+ * so clearing the screen or a line costs one store per row.
  */
 static void erase(struct my_sess *sh, int start, int len)
 {
-	char *x = sh->page + start*BYTES;
-	DBG(3, "x %p start %d pagelen %d len %d\n", x, start, sh->pagelen, len);
-    if(UTF8) {
-        uint16_t *p=(uint16_t *)x;
-        int i;
-        for(i=0;i<len;i++)*p++=0x20;
-    } else memset(x, ' ', len);
-	memset(sh->attributes+start, sh->cur_attr, len);
+	DBG(3, "start %d pagelen %d len %d\n", start, sh->pagelen, len);
+	touch(sh, start, len);
+	if (start + len > sh->pagelen)
+		len = sh->pagelen - start;
+	while (len > 0) {
+		int row = start / sh->cols, c0 = start % sh->cols;
+		int c1 = (c0 + len < sh->cols) ? c0 + len : sh->cols;
+
+		if (c1 == sh->cols) {	/* to the end of the row */
+			if (sh->blank[row] < c0 &&
+			    sh->blank_attr[row] != sh->cur_attr)
+				materialize(sh, row, c0);
+			if (sh->blank[row] >= c0) {
+				sh->blank[row] = c0;
+				sh->blank_attr[row] = sh->cur_attr;
+			}
+		} else if (c0 < sh->blank[row] ||
+			    sh->blank_attr[row] != sh->cur_attr) {
+			materialize(sh, row, c1);
+			fill_blank(sh, row, c0, c1, sh->cur_attr);
+		}
+		start += c1 - c0;
+		len -= c1 - c0;
+	}
 }
 
-/* scroll up one line, erase last line */
-static void page_scroll(struct my_sess *sh)
+/* append a row of chars and attributes to the scrollback */
+static void sb_push(struct my_sess *sh, const void *row, const void *attr)
 {
-	char *p = sh->page + sh->scroll_top * sh->cols * BYTES;
-	int l = (sh->scroll_bottom - sh->scroll_top - 1) * sh->cols;
-DBG(1, " scroll %i %i  %i  %i\n", sh->scroll_top, sh->scroll_bottom, l, p-sh->page);
-
-    if(!sh->scroll_top && sh->sb_lines) {
         char *t;
+        sh->sb_pushed++;
         if (sh->top<sh->sb_lines-1)sh->top++;
+        else sh->st_evicted++;
         if(sh->top>1) {
             t=sh->sb_page+(sh->sb_lines-sh->top)*sh->cols*BYTES;
             memmove(t-sh->cols*BYTES, t, (sh->top)*sh->cols*BYTES);
             t=sh->sb_attributes+(sh->sb_lines-sh->top)*sh->cols;
             memmove(t-sh->cols, t, (sh->top)*sh->cols);
         }
-        memcpy(sh->sb_page+(sh->sb_lines-1)*sh->cols*BYTES, sh->page, sh->cols*BYTES);
-        memcpy(sh->sb_attributes+(sh->sb_lines-1)*sh->cols, sh->attributes, sh->cols);
+        memcpy(sh->sb_page+(sh->sb_lines-1)*sh->cols*BYTES, row, sh->cols*BYTES);
+        memcpy(sh->sb_attributes+(sh->sb_lines-1)*sh->cols, attr, sh->cols);
+}
 
+/* scroll up one line, erase last line */
+static void page_scroll(struct my_sess *sh)
+{
+	char *p = sh->page + sh->scroll_top * sh->cols * BYTES;
+	int l = (sh->scroll_bottom - sh->scroll_top - 1) * sh->cols;
+DBG(1, " scroll %i %i  %i  %i\n", sh->scroll_top, sh->scroll_bottom, l, p-sh->page);
+	sh->st_scrolls++;
+
+    if(!sh->scroll_top && sh->sb_lines) {
+        materialize(sh, 0, sh->cols);
+        sb_push(sh, sh->page, sh->attributes);
     }
 	memmove(p, p + sh->cols*BYTES, l*BYTES);
 	p = sh->attributes + sh->scroll_top * sh->cols;	/* move to attributes */
 	memmove(p, p + sh->cols, l);
+	l = sh->scroll_bottom - sh->scroll_top - 1;	/* now in rows */
+	memmove(sh->blank + sh->scroll_top, sh->blank + sh->scroll_top + 1,
+		l*sizeof(*sh->blank));
+	memmove(sh->blank_attr + sh->scroll_top,
+		sh->blank_attr + sh->scroll_top + 1, l);
+	touch(sh, sh->scroll_top * sh->cols, l * sh->cols);
 	erase(sh, (sh->scroll_bottom - 1)*sh->cols, sh->cols);
 }
 
@@ -227,9 +587,16 @@ static void page_scrolldown(struct my_sess *sh)
 	char *p = sh->page + sh->scroll_top * sh->cols * BYTES;
 	int l = (sh->scroll_bottom - sh->scroll_top - 1) * sh->cols;
 DBG(0, " scrolldown %i %i  %i  %i\n", sh->scroll_top, sh->scroll_bottom, l, p-sh->page);
+	sh->st_scrolls++;
 	memmove(p+ sh->cols*BYTES, p, l*BYTES);
 	p = sh->attributes + sh->scroll_top * sh->cols;	/* move to attributes */
 	memmove(p+ sh->cols, p, l);
+	l = sh->scroll_bottom - sh->scroll_top - 1;	/* now in rows */
+	memmove(sh->blank + sh->scroll_top + 1, sh->blank + sh->scroll_top,
+		l*sizeof(*sh->blank));
+	memmove(sh->blank_attr + sh->scroll_top + 1,
+		sh->blank_attr + sh->scroll_top, l);
+	touch(sh, (sh->scroll_top + 1) * sh->cols, l * sh->cols);
 	erase(sh, sh->scroll_top * sh->cols, sh->cols);
 }
 #define B() do {	\
@@ -280,6 +647,8 @@ static int do_csi(struct my_sess *sh, char **s, int curcol)
 	if (!cmd)
 		return 1; // process later
 	*s = parm;
+	if ((uint8_t)cmd >= '@' && (uint8_t)cmd <= '~')
+		sh->st_csi[(uint8_t)cmd - '@']++;
 	/* XXX parse a variable number of args */
 	n = sscanf(base, "%d;%d;%d", &a1, &a2, &a3);
 	/* print potentially invalid commands */
@@ -291,6 +660,8 @@ static int do_csi(struct my_sess *sh, char **s, int curcol)
 		{
 			if (curcol + a1 > sh->cols)
 				a1 = sh->cols - curcol;
+			materialize(sh, sh->cur / sh->cols, sh->cols);
+			touch(sh, sh->cur, sh->cols - curcol);
 			char *dst = sh->page + (sh->cur+a1)*BYTES;
 			int l = sh->cols - curcol - a1;
 			memmove(dst, dst - a1*BYTES, l*BYTES);
@@ -579,6 +950,8 @@ static int do_csi(struct my_sess *sh, char **s, int curcol)
         break;
 	case 'P': /* delete n characters */
 		if (curcol + a1 < sh->cols) {
+			materialize(sh, sh->cur / sh->cols, sh->cols);
+			touch(sh, sh->cur, sh->cols - curcol);
 			char *dst = sh->page + sh->cur*BYTES;
 			int l = sh->cols - curcol - a1;
 			memcpy(dst, dst + a1*BYTES, l*BYTES);
@@ -620,6 +993,8 @@ static int do_csi(struct my_sess *sh, char **s, int curcol)
 		break;
 	default:
 	notfound:
+		sh->st_unknown++;
+		TRACE(1, TR_SEQ, cmd, mark, sh->cur);
 		DBG(0, "-- at %4d ANSI sequence (%d) %d %d %d ( ESC-[%c%.*s)\n",
 			sh->cur,
 			n, a1, a2, a3, mark, (parm+1 - base), base);	
@@ -675,7 +1050,7 @@ static char *page_append(struct my_sess *sh, char *s)
 
     for (; *s; ) {
         int c;
-        char *ns;
+        char *ns = s;
         int curcol;
        
         if(UTF8) {
@@ -730,6 +1105,7 @@ static char *page_append(struct my_sess *sh, char *s)
                         goto done;	/* continue later */
                     ns=s+1;
                 } else {
+                    sh->st_esc++;
                     if (!index("()>=HcDEM#", s[1]))
                         DBG(0, "other ESC-%.*s\n", 1, s+1);
                     /*
@@ -756,6 +1132,8 @@ static char *page_append(struct my_sess *sh, char *s)
                                 sh->kflags &= ~(kf_graphics | kf_dographic);
                                 break;
                             default:
+                                sh->st_unknown++;
+                                TRACE(1, TR_SEQ, *s, s[-1], sh->cur);
                                 DBG(0, "unrecognised ESC ( %c\n", *s);
                         }
                     } else if (index("H=>", s[1])) { /* ignore these */
@@ -809,15 +1187,19 @@ DBG(0, "auto Scrolling\n");
                     } else if(s[1]=='#') { /* DEC */
                         DBG(0, "ESC-# %c, ignoring.\n", s[2]);
                         if(s[2]=='8') {
+                            int i;
                             if(UTF8) {
-                                int i;
                                 for(i=0;i<sh->pagelen;i++)sh->page16[i]='E';
                             } else memset(sh->page, 'E', sh->pagelen);
                             memset(sh->attributes, sh->cur_attr, sh->pagelen);
+                            for(i=0;i<sh->rows;i++)sh->blank[i]=sh->cols;
+                            touch(sh, 0, sh->pagelen);
                         }
                         s+=2;
                         if(UTF8)ns+=2;
                     } else {
+                        sh->st_unknown++;
+                        TRACE(1, TR_SEQ, s[1], '\033', sh->cur);
                         DBG(0, "non ANSI sequence %d ESC-%c\n", s[1], s[1]);
                         s++;	/* skip the char */
                         if(UTF8)ns++;
@@ -843,6 +1225,9 @@ DBG(0, "auto Scrolling\n");
                     page_scroll(sh);
                 }
                 if (c != '\n') { /* already handled above */
+                    touch(sh, sh->cur, 1);
+                    if (curcol >= sh->blank[sh->cur / sh->cols])
+                        materialize(sh, sh->cur / sh->cols, curcol + 1);
                     if (c >= 0x60 && c < 0x7f &&
                         (sh->kflags & kf_dographic) && sh->kflags & kf_graphics) { 
                         if(UTF8) 
@@ -880,9 +1265,165 @@ done:
     return s;
 }
 
+/*
+ * Hidden terminals can store their output in the lazy buffer and
+ * parse it when shown. When the buffer is full the oldest lines go
+ * to the scrollback as plain text, skipping escape sequences, after
+ * the current page, so the screen restarts from a blank page.
+ */
+static void lazy_spill(struct my_sess *sh, const char *s)
+{
+	uint16_t row[320];	/* term_new() limits cols */
+	uint8_t attr[320];
+	char *row8 = (char *)row;
+	const unsigned char *ns;
+	int c, i, col = 0;
+
+	if (!sh->spilled) {
+		for (i = 0; sh->sb_lines && i <= sh->cur / sh->cols; i++) {
+			materialize(sh, i, sh->cols);
+			sb_push(sh, sh->page + i * sh->cols * BYTES,
+				sh->attributes + i * sh->cols);
+		}
+		erase(sh, 0, sh->pagelen);
+		sh->cur = 0;
+		sh->sbuf[0] = '\0';	/* a partial sequence */
+		sh->spilled = 1;
+	}
+	if (!sh->sb_lines)
+		return;
+	memset(attr, 0, sizeof(attr));
+	for (i = 0; i < sh->cols; i++)
+		UTF8 ? (row[i] = ' ') : (row8[i] = ' ');
+	while (*s) {
+		if (*s == '\033') {	/* skip the sequence */
+			s++;
+			if (*s == '[') {
+				while (*++s && (*s < 0x40 || *s > 0x7e))
+					;
+			} else if (*s == ']') {	/* ends with BEL or ST */
+				while (*++s && *s != 7 && *s != '\033')
+					;
+			}
+			if (*s)
+				s++;
+			continue;
+		}
+		if (UTF8) {
+			c = utf8_to_ucs2((const unsigned char *)s, &ns);
+			if (c < 0) {
+				c = 0xfffd;
+				ns = (const unsigned char *)s + 1;
+			}
+			s = (const char *)ns;
+		} else
+			c = (uint8_t)*s++;
+		if (c == '\r')
+			col = 0;
+		else if (c == '\b' && col > 0)
+			col--;
+		else if (c == '\t')
+			col = (col + 8) & ~7;
+		if (c == '\n' || (c >= ' ' && c != 0x7f && col >= sh->cols)) {
+			sb_push(sh, row, attr);
+			for (i = 0; i < sh->cols; i++)
+				UTF8 ? (row[i] = ' ') : (row8[i] = ' ');
+			col = 0;
+		}
+		if (c < ' ' || c == 0x7f)
+			continue;
+		if (UTF8)
+			row[col++] = c;
+		else
+			row8[col++] = c;
+	}
+	if (col)
+		sb_push(sh, row, attr);
+}
+
+/* make room in the lazy buffer, dropping about half of it */
+static void lazy_drop(struct my_sess *sh)
+{
+	int n = sh->lazy_max / 2;
+	char c;
+
+	while (n > 0 && sh->lazy[n - 1] != '\n')	/* whole lines */
+		n--;
+	if (n == 0)
+		n = sh->lazy_max / 2;
+	DBG(1, "%s drops %d bytes\n", sh->name, n);
+	c = sh->lazy[n];
+	sh->lazy[n] = '\0';
+	lazy_spill(sh, sh->lazy);
+	sh->lazy[n] = c;
+	sh->lazy_len -= n;
+	memmove(sh->lazy, sh->lazy + n, sh->lazy_len);
+}
+
+/* parse the lazy buffer */
+static void lazy_parse(struct my_sess *sh)
+{
+	int i, n, spos;
+	char *s;
+
+	for (i = 0; i < sh->lazy_len; i += n) {
+		spos = strlen(sh->sbuf);
+		n = sizeof(sh->sbuf) - 1 - spos;
+		if (n > sh->lazy_len - i)
+			n = sh->lazy_len - i;
+		if (n == 0) {	/* no progress, drop it */
+			sh->sbuf[0] = '\0';
+			continue;
+		}
+		memcpy(sh->sbuf + spos, sh->lazy + i, n);
+		sh->sbuf[spos + n] = '\0';
+		s = page_append(sh, sh->sbuf);
+		strcpy(sh->sbuf, s);
+	}
+	DBG(1, "%s parsed %d bytes\n", sh->name, sh->lazy_len);
+	sh->lazy_len = 0;
+	sh->spilled = 0;
+	sh->modified = 1;
+}
+
+void term_lazy(struct sess *sess, int bytes)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+
+	if (!sh)
+		return;
+	if (bytes > 0 && bytes < SMAX)
+		bytes = SMAX;
+	if (sh->lazy && sh->lazy_max == bytes)
+		return;
+	LOCK(sh);
+	if (sh->lazy) {
+		lazy_parse(sh);
+		free(sh->lazy);
+		sh->lazy = NULL;
+	}
+	if (bytes > 0) {
+		sh->lazy = malloc(bytes + 1);	/* room for a nul */
+		sh->lazy_max = sh->lazy ? bytes : 0;
+	}
+	UNLOCK(sh);
+}
+
 static int term_keyboard(struct my_sess *sh)
 {
-	int l = write(sh->sess.fd, sh->keys, sh->klen);
+	int l;
+
+	if (sh->klen == 0) {	/* then the injected text */
+		l = write(sh->sess.fd, ds_data(sh->paste), ds_len(sh->paste));
+		if (l > 0)
+			ds_shift(sh->paste, l);
+		TRACE(1, TR_WRITE, sh->sess.fd, l, ds_len(sh->paste));
+		if (ds_len(sh->paste) == 0)
+			sess_watch(&sh->sess, sh->sess.fd, PTY_EVENTS(sh));
+		return l <= 0;
+	}
+	l = write(sh->sess.fd, sh->keys, sh->klen);
+	TRACE(1, TR_WRITE, sh->sess.fd, l, sh->klen - l);
 	if (l <= 0) {
 		DBG(1, "error writing to keyboard\n");
 		return 1; /* error, currently ignored */
@@ -892,56 +1433,254 @@ static int term_keyboard(struct my_sess *sh)
 	// ioctl(sh->sess.fd, TIOCDRAIN); // XXX blocks
 	strcpy(sh->keys, sh->keys + l);
 	sh->klen -= l;
+	if (sh->klen == 0)
+		sess_watch(&sh->sess, sh->sess.fd, PTY_EVENTS(sh));
 	return 0;
 }
 
-/* process screen output from the shell */
+/* process screen output from the shell.
+ * Returns 1 if the pty is gone, 2 if there was nothing to read.
+ * At most budget bytes are read, the rest on the next wakeup.
+ * Also run by the parser thread, which leaves the rest to the
+ * main loop.
+ */
 static int term_screen(struct my_sess *sh)
 {
-	char *s;
+	char *s, *buf;
 	int spos = strlen(sh->sbuf);
-	int l = read(sh->sess.fd, sh->sbuf + spos, sizeof(sh->sbuf) - 1 - spos);
+	int want = sizeof(sh->sbuf) - 1 - spos;
+	int l;
 
+	buf = sh->sbuf + spos;
+	if (sh->lazy) {	/* only store it */
+		if (sh->lazy_len == sh->lazy_max)
+			lazy_drop(sh);
+		buf = sh->lazy + sh->lazy_len;
+		want = sh->lazy_max - sh->lazy_len;
+	} else if (sh->budget && want > sh->budget)
+		want = sh->budget;
+	sh->more = 0;
+	l = read(sh->sess.fd, buf, want);
+	TRACE(1, TR_READ, sh->sess.fd, l, l < 0 ? errno : 0);
+	if (l < 0 && errno == EAGAIN)
+		return 2;
 	if (l <= 0) {
 		DBG(0, "--- shell read error, dead %d\n", l);
+		if (sh->thr)	/* closed by the main loop */
+			return 1;
+		sess_watch(&sh->sess, sh->sess.fd, 0);
+		close(sh->sess.fd);
 		sh->sess.fd = -1; /* report error. */
 		return 1;
 	}
+	sh->st_read += l;
+	/* maybe more in the pty. epoll and select report it again,
+	 * more lets term_budget() wake us at the new prio for it.
+	 */
+	if (l == want && !sh->thr) {
+		sh->more = 1;
+		sess_wake(&sh->sess);
+	}
+	if (sh->lazy) {
+		sh->lazy_len += l;
+		return 0;
+	}
 	spos += l;
 	sh->sbuf[spos] = '\0';
 	DBG(2, "got %d bytes for %s\n", l, sh->name);
 	sh->modified = 1; /* maybe not... */
 	s = page_append(sh, sh->sbuf); /* returns unprocessed pointer */
 	strcpy(sh->sbuf, s);
+	if (sh->pred_len && !sh->thr)	/* else in thr_note() */
+		pred_check(sh);
+	if (sh->viewer && !sh->thr)	/* not from the thread */
+		sess_wake(sh->viewer);
+	return 0;
+}
+
+static void *thr_main(void *arg)
+{
+	struct my_sess *sh = arg;
+	struct worker *w = sh->thr;
+	struct pollfd p[2] = {
+		{ .fd = sh->sess.fd, .events = POLLIN },
+		{ .fd = w->stop[0], .events = POLLIN } };
+	int ret = 0, note;
+
+	while (ret != 1) {
+		if (poll(p, 2, -1) < 0 && errno != EINTR)
+			break;
+		if (p[1].revents)
+			break;
+		if (!p[0].revents)
+			continue;
+		pthread_mutex_lock(&w->lock);
+		ret = term_screen(sh);
+		w->eof = (ret == 1);
+		note = ret != 2 && !w->notified;
+		if (note)
+			w->notified = 1;
+		pthread_mutex_unlock(&w->lock);
+		if (note && write(w->note[1], "", 1) < 0)
+			DBG(0, "cannot notify %s\n", sh->name);
+	}
+	return NULL;
+}
+
+/* the parser thread has new output, or the pty is gone */
+static void thr_note(struct my_sess *sh)
+{
+	struct worker *w = sh->thr;
+	char buf[16];
+	int eof;
+
+	while (read(w->note[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&w->lock);
+	w->notified = 0;
+	eof = w->eof;
+	if (sh->pred_len)
+		pred_check(sh);
+	pthread_mutex_unlock(&w->lock);
+	if (sh->viewer)
+		sess_wake(sh->viewer);
+	if (eof) {	/* back here to close it */
+		term_thread(&sh->sess, 0);
+		term_screen(sh);
+	}
+}
+
+static void thr_free(struct worker *w)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (w->note[i] >= 0)
+			close(w->note[i]);
+		if (w->stop[i] >= 0)
+			close(w->stop[i]);
+	}
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+int term_thread(struct sess *sess, int on)
+{
+	struct my_sess *sh = (struct my_sess *)sess;
+	struct worker *w;
+	int i, page, sb;
+
+	if (!sh || !on == !sh->thr)
+		return 0;
+	if (!on) {
+		w = sh->thr;
+		if (write(w->stop[1], "", 1) < 0)
+			DBG(0, "cannot stop %s\n", sh->name);
+		pthread_join(w->tid, NULL);
+		sess_watch(&sh->sess, w->note[0], 0);
+		sh->thr = NULL;
+		thr_free(w);
+		memset(sh->dirty, 1, sh->rows);	/* the reader had the snapshot */
+		sh->modified = 1;
+		sess_watch(&sh->sess, sh->sess.fd, PTY_EVENTS(sh));
+		sh->more = 1;	/* maybe unread output */
+		sess_wake(&sh->sess);
+		DBG(1, "%s parsed in the main loop\n", sh->name);
+		return 0;
+	}
+	if (sh->sess.fd < 0)
+		return -1;
+	/* the snapshot, 16 bit parts first */
+	page = sh->pagelen;
+	sb = sh->sb_lines * sh->cols;
+	w = calloc(1, sizeof(*w) + (page + sb)*(BYTES + 1) + sh->rows*4);
+	if (!w)
+		return -1;
+	w->page = (char *)(w + 1);
+	w->sb_page = w->page + page*BYTES;
+	w->blank = (uint16_t *)(w->sb_page + sb*BYTES);
+	w->attributes = (char *)(w->blank + sh->rows);
+	w->sb_attributes = w->attributes + page;
+	w->blank_attr = (uint8_t *)w->sb_attributes + sb;
+	w->dirty = (char *)w->blank_attr + sh->rows;
+	pthread_mutex_init(&w->lock, NULL);
+	w->note[0] = w->note[1] = w->stop[0] = w->stop[1] = -1;
+	if (pipe(w->note) || pipe(w->stop)) {
+		thr_free(w);
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {	/* not for the children */
+		fcntl(w->note[i], F_SETFD, FD_CLOEXEC);
+		fcntl(w->stop[i], F_SETFD, FD_CLOEXEC);
+		fcntl(w->note[i], F_SETFL, O_NONBLOCK);
+	}
+	memset(sh->dirty, 1, sh->rows);
+	w->sb_pushed = sh->sb_pushed - 1;	/* copy it all */
+	sh->thr = w;
+	sh->more = 0;
+	snap_take(sh);
+	if (pthread_create(&w->tid, NULL, thr_main, sh)) {
+		DBG(0, "no thread for %s\n", sh->name);
+		sh->thr = NULL;
+		thr_free(w);
+		memset(sh->dirty, 1, sh->rows);
+		return -1;
+	}
+	sess_watch(&sh->sess, sh->sess.fd, PTY_EVENTS(sh));
+	sess_watch(&sh->sess, w->note[0], SESS_READ);
+	DBG(1, "%s parsed by a thread\n", sh->name);
 	return 0;
 }
 
 /*
- * Callback for I/O with the shell
+ * Callback for I/O with the shell. The pty is watched with
+ * sess_watch(), for writing only while there are keys to send,
+ * and pred_timer is the prediction timeout.
  */
 int handle_shell(void *_s, struct cb_args *a)
 {
 	struct my_sess *sh = _s;
+	int ev = sess_ready(sh->sess.fd);
 
+	DBG(1, "run %p %s ev %d\n", sh, sh->name, ev);
+	LOCK(sh);
+	if (timer_fired(&sh->pred_timer) && sh->pred_len) {
+		DBG(1, "prediction timeout, suspended\n");
+		pred_rollback(sh);
+		sh->predict = -1;
+	}
+	UNLOCK(sh);
+	if (ev & SESS_WRITE)
+		term_keyboard(sh);
+	if (sh->thr) {	/* the thread reads the pty */
+		if (sess_ready(sh->thr->note[0]) & SESS_READ)
+			thr_note(sh);	/* can close the fd */
+	} else if ((ev & SESS_READ) || sh->more)
+		term_screen(sh); /* can close the fd */
+	if (sh->sess.flags & SF_EXITED) {
+		term_thread(&sh->sess, 0);
+		DBG(0, "shell %s pid %d %s %d\n", sh->name, sh->pid,
+			WIFSIGNALED(sh->sess.status) ? "killed by" : "exited",
+			WIFSIGNALED(sh->sess.status) ?
+			WTERMSIG(sh->sess.status) : WEXITSTATUS(sh->sess.status));
+		/* show its last output, then drop the pty */
+		while (sh->sess.fd >= 0 && term_screen(sh) == 0)
+			;
+		if (sh->sess.fd >= 0) {
+			sess_watch(&sh->sess, sh->sess.fd, 0);
+			close(sh->sess.fd);
+			sh->sess.fd = -1;
+		}
+	}
 	if (sh->sess.fd < 0) { /* dead */
-		if (a->run == 0)
-			return 0;
+		timer_stop(&sh->pred_timer);
 		if (sh->cb)
 			sh->cb(_s);
+		free(sh->lazy);
+		ds_free(sh->paste);
 		free(sh);	/* otherwise destroy */
 		return 1;
 	}
-	DBG(1, "poll %p %s\n", sh, sh->name);
-	if (a->run == 0) {
-		FD_SET(sh->sess.fd, a->r);
-		if (sh->klen)	/* have bytes to send to keyboard */
-			FD_SET(sh->sess.fd, a->w);
-		return 1;
-	}
-	if (FD_ISSET(sh->sess.fd, a->w))
-		term_keyboard(sh);
-	if (FD_ISSET(sh->sess.fd, a->r))
-		term_screen(sh); /* can close the fd. handle later */
 	return 0;
 }
 
@@ -956,7 +1695,7 @@ struct sess *term_new(char *cmd, const char *name,
 	struct winsize ws;
 	struct my_sess *s;
 
-	if (rows < 4 || rows > 160)
+	if (rows < 4 || rows > MAX_ROWS)
 		rows = 25;
 	if (cols < 10 || cols > 320)
 		cols = 80;
@@ -967,11 +1706,12 @@ struct sess *term_new(char *cmd, const char *name,
         if(UTF8) {
             if ((sizeof(*s)+ln)&1) ln++; /* make sure page is aligned */
         }
-        s = new_sess(sizeof(*s) + ln + l*(1+BYTES) + cols*(1+BYTES)*sb_lines+1 , -2, handle_shell, NULL);
+        s = new_sess(sizeof(*s) + ln + l*(1+BYTES) + cols*(1+BYTES)*sb_lines+1 + 4*rows+1, -2, handle_shell, NULL);
         if (!s) {
 		DBG(0, "failed to create session for %s\n", name);
 		return NULL;
 	}
+	stats_name(handle_shell, "terminal");
     s->cb = cb;
     s->allrows = 1000;
     s->rows = rows;
@@ -995,6 +1735,11 @@ struct sess *term_new(char *cmd, const char *name,
         s->sb_page=(char *)(((unsigned long)(s->page+l*(1+BYTES)+1))&(~1ul));
         s->sb_attributes=s->sb_page+sb_lines*cols*BYTES;
     } else s->sb_page=NULL;
+    s->dirty = s->page + l*(1+BYTES) + cols*(1+BYTES)*sb_lines + 1;
+    s->blank = (uint16_t *)(((unsigned long)(s->dirty + rows + 1))&(~1ul));
+    s->blank_attr = (uint8_t *)(s->blank + rows);
+    for (l = 0; l < rows; l++)
+        s->blank[l] = cols;
     erase(s, 0, s->pagelen);
     strcpy(s->name, name);
 
@@ -1007,16 +1752,21 @@ struct sess *term_new(char *cmd, const char *name,
 	    DBG(0, "forkpty failed\n");
 	    /* failed. mark session as dying, will be freed later */
 	    s->sess.fd = -1; /*mark as dying */
+	    sess_wake(&s->sess);	/* to be freed */
 	    return NULL;
 	}
 	if (s->pid == 0) { /* this is the child, execvp the shell */
 	    char *av[] = { cmd, NULL};
+	    sig_reset();
 	    //putenv("TERM=linux");
         putenv("ENV=/mnt/us/myts/profile");
 	    execvp(av[0], av);
 	    exit(1); /* notreached normally */
 	}
 	fcntl(s->sess.fd, F_SETFL, O_NONBLOCK);
+	s->sess.flags &= ~SF_POLL;
+	sess_child(&s->sess, s->pid);
+	sess_watch(&s->sess, s->sess.fd, SESS_READ);
         return (struct sess *)s;
 }
 
@@ -1033,6 +1783,33 @@ int term_kill(struct sess *sess, int sig)
 	return 0;
 }
 
+void term_stats(dynstr *out)
+{
+	struct sess *s;
+	struct my_sess *sh;
+	const char *name;
+	int i;
+
+	for (s = __me.sess; s; s = s->next) {
+		if (s->cb != handle_shell)
+			continue;
+		sh = (struct my_sess *)s;
+		name = sh->name[0] ? sh->name : "-";	/* spare shells */
+		LOCK(sh);
+		dsprintf(out, "term %s read %llu scrolls %u evicted %u "
+			"esc %u unknown %u\n", name,
+			(unsigned long long)sh->st_read, sh->st_scrolls,
+			sh->st_evicted, sh->st_esc, sh->st_unknown);
+		dsprintf(out, "term %s csi", name);
+		for (i = 0; i <= '~' - '@'; i++) {
+			if (sh->st_csi[i])
+				dsprintf(out, " %c %u", '@' + i, sh->st_csi[i]);
+		}
+		dsprintf(out, "\n");
+		UNLOCK(sh);
+	}
+}
+
 struct sess *term_find(const char *name)
 {
 	struct sess *s;
@@ -28,6 +28,8 @@
 #ifndef _TERMINAL_H_
 #define _TERMINAL_H_
 
+#include "dynstring.h"
+
 /*
  * terminal support for kiterm and launchpad.
  * The routines support creation of a terminal session,
@@ -35,6 +37,9 @@
  * and exporting the framebuffer.
  */
 
+/* max rows of a terminal, term_new() clamps to it */
+#define MAX_ROWS	160
+
 /*
  * term_new creates a session, and possibly specifies a callback to invoke
  * on special events (typically destruction).
@@ -51,6 +56,44 @@ const char *term_name(struct sess *s);
 /* send nul-terminated string to the terminal */
 int term_keyin(struct sess *, char *k);
 
+/*
+ * send len bytes to the shell as they are, after the pending keys.
+ * Returns -1 if too much is already queued.
+ */
+int term_inject(struct sess *, const char *buf, int len);
+
+/* enable or disable local echo prediction */
+void term_predict(struct sess *, int on);
+
+/*
+ * limit the output parsed per wakeup to bytes (0 no limit), and run
+ * the session after the unlimited ones. Used for hidden terminals.
+ */
+void term_budget(struct sess *, int bytes);
+
+/*
+ * wake viewer (NULL for none) whenever new output has been parsed,
+ * so that the shown terminal is drawn in the same loop.
+ */
+void term_viewer(struct sess *, struct sess *viewer);
+
+/*
+ * with bytes > 0 only store the output, at most bytes of it, and
+ * parse it when called again with 0. Older output goes to the
+ * scrollback as plain text. Used for hidden terminals.
+ */
+void term_lazy(struct sess *, int bytes);
+
+/*
+ * with on, read and parse the output in a thread of its own, and
+ * show a snapshot of the page updated by term_state(). Off stops
+ * the thread. Returns -1 if the thread cannot be started.
+ */
+int term_thread(struct sess *, int on);
+
+/* append the counters of all terminals to out, a few lines each */
+void term_stats(dynstr *out);
+
 /* send a signal to the terminal session */
 int term_kill(struct sess *sh, int sig);
 
@@ -58,6 +101,8 @@ int term_kill(struct sess *sh, int sig);
  * terminal state. The flags can be used to update modified, callback, name
  * when calling term_state(s, ptr) with a non-null ptr.
  * For convenience, term_state() returns the 'modified' state.
+ * dmg_lo..dmg_hi is the range of chars written since the last
+ * call with TS_MOD (empty if dmg_hi <= dmg_lo), cursor moves excluded.
  */
 enum { TS_MOD = 1, TS_CB = 2, TS_NAME = 4 };
 struct term_state {
@@ -71,6 +116,18 @@ struct term_state {
     char *attr;
 	char *sb_data;
     char *sb_attr;
+	char *dirty;	/* per-row modified flags, the reader clears them */
+	int dmg_lo, dmg_hi;	/* chars changed, reset with TS_MOD */
+	/* row r of data/attr is blank with attribute blank_attr[r]
+	 * from column blank[r] on, and the content there is stale.
+	 */
+	uint16_t *blank;
+	uint8_t *blank_attr;
+	/* predicted chars not yet echoed, to be shown from pred_cur on.
+	 * cur is already past them.
+	 */
+	uint16_t *pred;
+	int pred_cur, pred_len;
 };
 int term_state(struct sess *sh, struct term_state *ptr);
 
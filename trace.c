@@ -0,0 +1,122 @@
+/*
+ * Binary trace ring, see trace.h
+ *
+ * Each record is a timestamp, the event, the thread and 3 ints, and
+ * costs a clock read and an atomic increment, so the ring is always
+ * on and can tell what happened before a stall or a crash. The dump
+ * has a header, the names of the events and their args, then the
+ * records, oldest first, in host byte order. tracedump prints it
+ * (little endian only, as are the kindle and the pi).
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "myts.h"
+#include "trace.h"
+
+#define TRACE_RECS	8192	/* a power of 2 */
+#define TRACE_MAGIC	"MYT1"
+
+struct trace_rec {
+	uint32_t us;	/* CLOCK_MONOTONIC, wraps every 71 minutes */
+	uint16_t ev;
+	uint16_t thr;	/* 1 for the first thread recording, ... */
+	int32_t a[3];
+};
+
+/* the args of a:b are two 16 bit values, of c%c a char */
+static const char *names[TR_EVENTS] = {
+	[TR_WAKE] = "wake ready wait_us",
+	[TR_CB] = "cb fd prio us",
+	[TR_SIGNAL] = "signal sig crash",
+	[TR_EXIT] = "exit pid status",
+	[TR_READ] = "read fd bytes errno",
+	[TR_WRITE] = "write fd bytes left",
+	[TR_SEQ] = "seq final%c mark%c cur",
+	[TR_KEY] = "key dev code value",
+	[TR_SHOW] = "show fd rows cols",
+	[TR_FRAME] = "frame fast full glyphs",
+	[TR_UPDATE] = "update x:y w:h us",
+	[TR_CTL] = "ctl fd cmd%c len",
+};
+
+int trace_level = 1;
+static struct trace_rec ring[TRACE_RECS];
+static uint32_t head;	/* records ever written */
+static int nthr;
+static char path[256];	/* also used by the crash handler */
+
+void trace_rec(int ev, int a, int b, int c)
+{
+	static __thread int thr;
+	struct trace_rec *r;
+
+	if (thr == 0)
+		thr = __atomic_add_fetch(&nthr, 1, __ATOMIC_RELAXED);
+	r = ring + (__atomic_fetch_add(&head, 1, __ATOMIC_RELAXED) &
+		(TRACE_RECS - 1));
+	r->us = timer_us();
+	r->ev = ev;
+	r->thr = thr;
+	r->a[0] = a;
+	r->a[1] = b;
+	r->a[2] = c;
+}
+
+/* only write(), it also runs in the crash handler */
+int trace_dump(void)
+{
+	uint32_t hdr[6], n = head, first;
+	int fd, i, ok;
+
+	if (path[0] == '\0')
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	fchmod(fd, 0600);	/* also if it was there before */
+	first = n > TRACE_RECS ? n - TRACE_RECS : 0;
+	memcpy(hdr, TRACE_MAGIC, 4);
+	hdr[1] = TR_EVENTS;
+	hdr[2] = n - first;
+	hdr[3] = timer_us();	/* now, to show times before the dump */
+	hdr[4] = time(NULL);
+	hdr[5] = sizeof(struct trace_rec);
+	ok = write(fd, hdr, sizeof(hdr)) == sizeof(hdr);
+	for (i = 0; i < TR_EVENTS; i++)
+		ok &= write(fd, names[i], strlen(names[i]) + 1) > 0;
+	/* in two pieces if the ring wrapped */
+	i = first & (TRACE_RECS - 1);
+	if (n - first > TRACE_RECS - i) {
+		ok &= write(fd, ring + i, (TRACE_RECS - i) * sizeof(*ring)) > 0;
+		first += TRACE_RECS - i;
+		i = 0;
+	}
+	if (n > first)
+		ok &= write(fd, ring + i, (n - first) * sizeof(*ring)) > 0;
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+static void trace_crash(int sig)
+{
+	trace_rec(TR_SIGNAL, sig, 1, 0);
+	trace_dump();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void trace_file(const char *p)
+{
+	static const int crash[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	int i;
+
+	path[0] = '\0';
+	if (p && strlen(p) < sizeof(path))
+		strcpy(path, p);
+	for (i = 0; i < sizeof(crash) / sizeof(crash[0]); i++)
+		signal(crash[i], path[0] ? trace_crash : SIG_DFL);
+	DBG(1, "trace file %s\n", path);
+}
@@ -0,0 +1,48 @@
+/*
+ * Binary trace ring, see trace.c
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* the events, their names and args are in trace.c */
+enum trace_ev {
+	TR_WAKE,	/* the main loop woke up */
+	TR_CB,		/* a session callback ran */
+	TR_SIGNAL,
+	TR_EXIT,	/* a child was reaped */
+	TR_READ,	/* from a shell */
+	TR_WRITE,	/* to a shell */
+	TR_SEQ,		/* an escape sequence not handled */
+	TR_KEY,		/* an input event */
+	TR_SHOW,	/* a terminal was shown */
+	TR_FRAME,	/* a frame was drawn */
+	TR_UPDATE,	/* a screen update */
+	TR_CTL,		/* a control socket command */
+	TR_EVENTS
+};
+
+/*
+ * Record an event with up to 3 args if level <= trace_level.
+ * 0 is for rare events, 1 for each read, frame, update,
+ * 2 for each loop and callback, 3 for the keys typed.
+ * Safe from any thread.
+ */
+extern int trace_level;
+#define TRACE(level, ev, a, b, c)	do {			\
+		if ((level) <= trace_level)			\
+			trace_rec(ev, a, b, c);			\
+	} while (0)
+void trace_rec(int ev, int a, int b, int c);
+
+/*
+ * Set the file for trace_dump(), also written on crashes.
+ * NULL disables both.
+ */
+void trace_file(const char *path);
+/* write the ring to the file, see tracedump. Returns 0 if ok. */
+int trace_dump(void);
+
+#endif /* _TRACE_H_ */
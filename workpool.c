@@ -0,0 +1,134 @@
+/*
+ * A tiny fork/join worker pool, see workpool.h
+ *
+ * The pool is meant for short, CPU bound jobs such as rendering
+ * bands of the screen. Helper threads sleep on a condition variable
+ * and pick pieces of the current job; the caller also works on the
+ * job and then waits for the stragglers.
+ */
+
+#include <pthread.h>
+#include "myts.h"
+#include "workpool.h"
+
+#define POOL_MAX	8	/* helper threads */
+
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;	/* a new job is available */
+	pthread_cond_t	done;	/* the last piece of a job completed */
+	int		nthreads;	/* helpers, excluding the caller */
+	pthread_t	tid[POOL_MAX];
+	int		quit;
+	unsigned int	gen;	/* job generation, bumped by pool_run */
+
+	/* the current job */
+	pool_fn		fn;
+	void		*arg;
+	int		n, next, pending;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* run pieces of the current job until none is left. Lock held. */
+static void pool_drain(void)
+{
+	while (pool.next < pool.n) {
+		int i = pool.next++;
+
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(pool.arg, i);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+}
+
+static void *pool_thread(void *unused)
+{
+	unsigned int gen;
+
+	pthread_mutex_lock(&pool.lock);
+	gen = pool.gen;
+	for (;;) {
+		while (!pool.quit && gen == pool.gen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.quit)
+			break;
+		gen = pool.gen;
+		pool_drain();
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+void pool_run(int n, pool_fn fn, void *arg)
+{
+	int i;
+
+	if (pool.nthreads == 0 || n < 2) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pool.pending = n;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.work);
+	pool_drain();
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_free(void)
+{
+	int i;
+
+	if (pool.nthreads == 0)
+		return;
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.nthreads; i++)
+		pthread_join(pool.tid[i], NULL);
+	pool.nthreads = 0;
+	pool.quit = 0;
+}
+
+/*
+ * nthreads is the total number of threads working on a job,
+ * including the caller. It is clamped to the number of online cpus,
+ * so on a single core device we never create any thread.
+ */
+int pool_init(int nthreads)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (nthreads > ncpu)
+		nthreads = ncpu;
+	if (nthreads > POOL_MAX + 1)
+		nthreads = POOL_MAX + 1;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads - 1 == pool.nthreads)
+		return nthreads;
+	pool_free();
+	for (i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&pool.tid[i], NULL, pool_thread, NULL)) {
+			DBG(0, "cannot create render thread %d\n", i);
+			break;
+		}
+		pool.nthreads++;
+	}
+	DBG(1, "pool has %d helper threads\n", pool.nthreads);
+	return pool.nthreads + 1;
+}
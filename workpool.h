@@ -0,0 +1,21 @@
+/*
+ * A tiny fork/join worker pool.
+ *
+ * pool_run() splits a job into n independent pieces and runs
+ * fn(arg, i) for each i in [0, n), using the pool threads and the
+ * calling thread. It returns when all pieces are done.
+ * With a pool of 0 or 1 threads everything runs inline, so callers
+ * do not need a separate single threaded path.
+ */
+
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+typedef void (*pool_fn)(void *arg, int i);
+
+/* (re)size the pool, returns the number of threads actually usable */
+int pool_init(int nthreads);
+void pool_run(int n, pool_fn fn, void *arg);
+void pool_free(void);
+
+#endif /* _WORKPOOL_H_ */